@@ -12,6 +12,7 @@
 
 // std
 #include <variant>
+#include <atomic>
 
 namespace nos::vk
 {
@@ -46,8 +47,41 @@ struct nosVulkan_API ResourceBase : DeviceChild
 	T Handle;
 	VkDeviceSize Size;
 	std::optional<Allocation> AllocationInfo = std::nullopt;
+	// Incremented every time the resource is returned to a ResourcePool
+	std::atomic<u64> Generation = 0;
+	// Queue family that owns the resource, VK_QUEUE_FAMILY_IGNORED until its first use
+	u32 QueueFamily = VK_QUEUE_FAMILY_IGNORED;
+	bool OwnershipReleased = false;
 	using DeviceChild::DeviceChild;
+
+	bool IsOwnedBy(u32 family) const
+	{
+		return VK_QUEUE_FAMILY_IGNORED == QueueFamily || family == QueueFamily;
+	}
+
+	// Makes family the owner and returns the src/dst families for the acquire barrier.
+	// The release half must have been recorded on the previous owner with ReleaseOwnership.
+	std::pair<u32, u32> AcquireOwnership(u32 family, bool discardContents)
+	{
+		std::pair<u32, u32> families = {VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED};
+		if (!IsOwnedBy(family) && !discardContents)
+		{
+			if (!OwnershipReleased)
+				GLog.W("Resource is used on queue family %u without being released from queue family %u", family, QueueFamily);
+			families = {QueueFamily, family};
+		}
+		QueueFamily = family;
+		OwnershipReleased = false;
+		return families;
+	}
 	
+	// Forgets the owning queue family, the next user takes the resource without an acquire
+	void ResetOwnership()
+	{
+		QueueFamily = VK_QUEUE_FAMILY_IGNORED;
+		OwnershipReleased = false;
+	}
+
 	MemoryExportInfo GetExportInfo() const
 	{
 		if (!AllocationInfo)
@@ -31,8 +31,9 @@ struct nosVulkan_API Binding
         u32 BufferOffset;
         VkFilter Filter;
     };
+    u32 BufferRange = 0; // 0 for the rest of the buffer
     Binding() = default;
-    Binding(rc<Buffer> res, u32 binding, u32 bufferOffset, u32 arrayIdx);
+    Binding(rc<Buffer> res, u32 binding, u32 bufferOffset, u32 arrayIdx, u32 bufferRange = 0);
     Binding(rc<Image> res,  u32 binding, VkFilter filter, u32 arrayIdx);
 
     DescriptorResourceInfo GetDescriptorInfo(VkDescriptorType type) const;
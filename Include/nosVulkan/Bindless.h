@@ -0,0 +1,90 @@
+/*
+ * Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+ */
+
+#pragma once
+
+#include "Layout.h"
+
+namespace nos::vk
+{
+
+// Device wide update-after-bind descriptor set holding every registered image view and buffer.
+// Registered resources keep a stable slot until they are destroyed, i.e. until a ResourcePool evicts them
+// and every command buffer that took their index through GetBindlessIndex completes.
+// Shaders index the arrays with integers passed through push constants:
+//   set = N, binding 0: texture2D Textures[]       (sampled images)
+//   set = N, binding 1: image2D   Images[]         (storage images)
+//   set = N, binding 2: buffer    Buffers[]        (storage buffers)
+//   set = N, binding 3: sampler   Samplers[]       (NearestSampler, LinearSampler)
+// A pipeline layout whose set declares these runtime arrays binds the heap in place of a pooled set.
+struct nosVulkan_API BindlessHeap : SharedFactory<BindlessHeap>, DeviceChild
+{
+    enum : u32
+    {
+        SampledImageBinding,
+        StorageImageBinding,
+        StorageBufferBinding,
+        SamplerBinding,
+        BindingCount,
+    };
+
+    enum : u32
+    {
+        NearestSampler,
+        LinearSampler,
+        SamplerCount,
+    };
+
+    static constexpr u32 InvalidIndex = ~0u;
+    static constexpr u32 DefaultSampledImages = 16384;
+    static constexpr u32 DefaultStorageImages = 4096;
+    static constexpr u32 DefaultStorageBuffers = 16384;
+
+    static constexpr VkDescriptorType Types[BindingCount] = {
+        VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+        VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_SAMPLER,
+    };
+
+    static constexpr VkDescriptorSetLayoutCreateFlags LayoutFlags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+    static constexpr VkDescriptorBindingFlags BindingFlags = VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+
+    u32 Capacity[BindingCount] = {};
+    rc<DescriptorLayout> Layout;
+    VkDescriptorPool Pool = 0;
+    VkDescriptorSet Set = 0;
+
+    BindlessHeap(Device* Vk);
+    ~BindlessHeap();
+
+    // True if every binding of the set is one of the heap's arrays, unsized except for the samplers
+    static bool Matches(std::map<u32, NamedDSLBinding> const& set);
+    // The heap's bindings, names and types are taken from the shader's set when present
+    std::map<u32, NamedDSLBinding> GetBindings(std::map<u32, NamedDSLBinding> const& set = {}) const;
+
+    // Returns the view's slot in the sampled or storage image array, registering it on first use.
+    // InvalidIndex if the view lacks the sampled or storage usage the array needs.
+    u32 Register(ImageView* view, VkDescriptorType type);
+    // Returns the buffer's slot in the storage buffer array, registering it on first use.
+    // InvalidIndex if the buffer lacks storage buffer usage.
+    u32 Register(Buffer* buffer);
+    // Called by the resource destructors, the slot is handed out again to the next registration.
+    // Use Image::GetBindlessIndex and Buffer::GetBindlessIndex rather than Register, they keep the resource alive.
+    void Unregister(u32 binding, u32 index);
+
+    void Bind(rc<CommandBuffer> Cmd, VkPipelineBindPoint BindPoint, VkPipelineLayout PipelineLayout, u32 SetIndex);
+
+    u32 GetRegisteredCount(u32 binding);
+
+protected:
+    std::mutex Mutex;
+    u32 Next[BindingCount] = {};
+    std::vector<u32> FreeIndices[BindingCount];
+
+    u32 Allocate(u32 binding);
+    void Write(u32 binding, u32 index, DescriptorResourceInfo const& info);
+};
+
+} // namespace nos::vk
@@ -20,6 +20,7 @@ struct nosVulkan_API Buffer : SharedFactory<Buffer>, ResourceBase<VkBuffer>
 	vk::Buffer* AsBuffer() override { return this; }
     VkBufferUsageFlags Usage;
 	BufferMemoryState State;
+	WriteScope LastWrite = {}; // Readers State does not cover wait on it
     
     void Copy(size_t len, const void* pp, size_t offset = 0);
 
@@ -33,13 +34,26 @@ struct nosVulkan_API Buffer : SharedFactory<Buffer>, ResourceBase<VkBuffer>
 
     void Bind(VkDescriptorType type, u32 bind, VkDescriptorSet set);
     DescriptorResourceInfo GetDescriptorInfo() const;
+    // Slot in the device's BindlessHeap storage buffer array, registers the buffer on first use.
+    // Cmd retains the buffer, so the slot is not handed out again before the shaders indexing it complete.
+    u32 GetBindlessIndex(rc<CommandBuffer> Cmd);
+    u32 BindlessIndex = ~0u;
+    // Only available for descriptor and uniform/storage buffers when the device uses descriptor buffers
+    VkDeviceAddress GetAddress() const;
+
+    // Called when a pool hands the buffer to a new user: ownership and state are reset as if it was just created
+    void DiscardContents();
 
     Buffer(Device* Vk, BufferCreateInfo const& info);
     ~Buffer();
 
     void Upload(rc<CommandBuffer> Cmd, rc<Buffer> Buffer, const VkBufferCopy* Region = 0);
+    // Copies data through the device staging ring
+    void Upload(rc<CommandBuffer> Cmd, const void* data, VkDeviceSize size, VkDeviceSize dstOffset = 0);
 
 	void Transition(rc<CommandBuffer> cmd, BufferMemoryState dst, VkDeviceSize offset, VkDeviceSize size);
+	// See Image::ReleaseOwnership
+	void ReleaseOwnership(rc<CommandBuffer> cmd, u32 dstFamily);
 	uint32_t Alignment;
 	int ElementType;
 };
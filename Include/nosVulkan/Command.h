@@ -5,7 +5,12 @@
 #pragma once
 
 #include "Common.h"
+#include "MPSCQueue.hpp"
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <thread>
 namespace nos::vk
 {
 
@@ -18,26 +23,105 @@ struct nosVulkan_API Queue : SharedFactory<Queue>, VklQueueFunctions
     std::mutex Mutex;
 
     Queue(Device* Device, u32 Family, u32 Index);
+    ~Queue();
     Device* GetDevice();
     VkResult Submit(uint32_t submitCount, const VkSubmitInfo* pSubmits, VkFence fence);
-    VkResult Submit(std::vector<rc<CommandBuffer>> const& cmd);
+    // Submits the command buffers with one vkQueueSubmit2, each with its own wait and signal groups.
+    // All of them must come from pools of this queue.
+    VkResult Submit(std::vector<rc<CommandBuffer>> const& cmds);
     void Wait() 
     {
         std::unique_lock lock(Mutex);
         WaitIdle();
     }
+
+    // Starts a worker that submits command buffers handed over with SubmitAsync.
+    // Requests arriving within coalesceWindow of the first one are submitted together, up to maxBatch command buffers.
+    void StartSubmitThread(std::chrono::microseconds coalesceWindow = std::chrono::microseconds(100), u32 maxBatch = 64);
+    // Submits everything still queued, then joins the worker. Tickets can no longer be waited on afterwards.
+    void StopSubmitThread();
+    bool HasSubmitThread() const { return SubmitThread.joinable(); }
+
+    // Hands the command buffer over to the submit thread and returns a ticket for WaitForTicket.
+    // The command buffer must not be touched by the caller afterwards.
+    u64 SubmitAsync(rc<CommandBuffer> cmd);
+    bool WaitForTicket(u64 ticket, u64 timeoutNs = UINT64_MAX);
+    u64 GetCompletedTicket();
+    // Timeline semaphore of the submit thread, reaches a ticket once it and every ticket before it are complete
+    VkSemaphore GetTicketSemaphore() const { return TicketTimeline; }
+
+protected:
+    VkResult SubmitBatch(std::vector<rc<CommandBuffer>> const& cmds, VkSemaphore signal, u64 signalValue);
+    void SubmitThreadMain();
+
+    struct SubmitRequest
+    {
+        rc<CommandBuffer> Cmd;
+        u64 Ticket = 0;
+    };
+
+    MPSCQueue<SubmitRequest> PendingSubmits;
+    // Bumped on every push and on stop. The idle worker waits on the counter itself, while coalescing it sleeps
+    // on SubmitWakeCV until the window ends. Producers never take SubmitWakeMutex, a missed notify only ends the
+    // coalesce window at its deadline instead of early.
+    std::atomic_uint64_t SubmitWake = 0;
+    std::mutex SubmitWakeMutex;
+    std::condition_variable SubmitWakeCV;
+    std::atomic_bool StopSubmit = false;
+    std::atomic_uint64_t NextTicket = 0;
+    u64 SubmittedTicket = 0; // Highest ticket that has been submitted along with every ticket before it
+    VkSemaphore TicketTimeline = VK_NULL_HANDLE;
+    std::chrono::microseconds CoalesceWindow{};
+    u32 MaxSubmitBatch = 64;
+    std::thread SubmitThread;
 };
 
 template <class T>
-void EndResourceDependency(rc<T> Resource)
+void EndResourceDependency(void* Resource)
 {
     if constexpr (std::same_as<T, Image>)
     {
-        Resource->State.AccessMask = VK_ACCESS_MEMORY_WRITE_BIT | VK_ACCESS_MEMORY_READ_BIT;
-        Resource->State.StageMask  = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+        static_cast<T*>(Resource)->State.AccessMask = VK_ACCESS_MEMORY_WRITE_BIT | VK_ACCESS_MEMORY_READ_BIT;
+        static_cast<T*>(Resource)->State.StageMask  = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
     }
 }
 
+// References kept alive by a command buffer until it completes. Entries and the lookup table keep their
+// storage across Release, so a recording only allocates while it retains more objects than any before it.
+// Retaining an object that is already in the list is a lookup without a refcount increment.
+class nosVulkan_API RetainList
+{
+public:
+    using EndFn = void (*)(void*);
+
+    template <class T>
+    void Retain(rc<T> const& Resource, EndFn End = nullptr)
+    {
+        if (!Resource)
+            return;
+        u32 slot;
+        if (Insert(Resource.get(), slot))
+            Entries.push_back(Entry{Resource, End, slot});
+    }
+
+    // Drops the references, calling the end functions first unless runEnd is false
+    void Release(bool runEnd = true);
+    size_t Size() const { return Entries.size(); }
+
+private:
+    struct Entry
+    {
+        std::shared_ptr<void> Ref;
+        EndFn End;
+        u32 Slot;
+    };
+    std::vector<Entry> Entries;
+    std::vector<void*> Slots; // Open addressing with linear probing, size is a power of two
+
+    bool Insert(void* key, u32& slot);
+    void Rehash(size_t capacity);
+};
+
 struct nosVulkan_API CommandBuffer : SharedFactory<CommandBuffer>,
                                     VklCommandFunctions
 {
@@ -51,46 +135,146 @@ struct nosVulkan_API CommandBuffer : SharedFactory<CommandBuffer>,
     };
 
     CommandPool* Pool;
-    VkFence Fence;
+    VkCommandBufferLevel Level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    VkFence Fence; // Only signaled by a batch for its last buffer, completion is read from Pool->Timeline
+    uint64_t SubmitValue = 0; // Value of Pool->Timeline that marks the completion of the last submission
+    // Unique across all command buffers, changes with every Clear. Unlike SubmitValue it also tells apart
+    // recordings of secondaries and of buffers cleared without being submitted.
+    u64 RecordingEpoch = 0;
     std::vector<std::function<void()>> Callbacks;
     std::vector<std::function<void(rc<CommandBuffer>)>> PreSubmit;
     std::map<VkSemaphore, std::pair<uint64_t, VkPipelineStageFlags>> WaitGroup;
     std::map<VkSemaphore, uint64_t> SignalGroup;
     std::atomic<State> State = Initial;
+    // Descriptor buffer bound by PipelineLayout::BindDescriptorBuffers, rebinding it invalidates every set's offsets
+    VkDeviceAddress DescriptorBufferAddress = 0;
     bool IsFree();
+    bool IsComplete();
 	bool Wait(uint64_t timeOutNs = 3000000000ull);
 	void WaitAndClear();
     void Clear();
     VkResult Begin(const VkCommandBufferBeginInfo* info);
 	void UpdatePendingState();
-    CommandBuffer(CommandPool* Pool, VkCommandBuffer Handle);
+    CommandBuffer(CommandPool* Pool, VkCommandBuffer Handle, VkCommandBufferLevel Level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
 
     ~CommandBuffer();
 
     Device* GetDevice();
     rc<CommandBuffer> Submit();
 
+    // Completion work swapped out of the buffer on submission when the device runs a CompletionDispatcher.
+    // The buffer keeps it and swaps it again on its next submission, so the lists keep their storage.
+    struct Completion
+    {
+        std::vector<std::function<void()>> Callbacks;
+        RetainList Retained;
+        std::vector<rc<CommandBuffer>> Secondaries;
+        std::atomic_bool Claimed = false;
+        std::atomic<std::thread::id> Runner;
+        std::atomic_bool Done = false;
+        // Runs once, on whichever of the dispatcher and Clear gets to it first.
+        // Retained images keep the state they were recorded with, other threads may be recording them.
+        void Run();
+    };
+
+    // Records the secondaries in order, ending the ones still recording. Their wait and signal groups move to this
+    // buffer, and they go back to their own pools once this buffer completes.
+    // Secondaries can be recorded in parallel, each on the thread that owns its pool.
+    void Execute(std::vector<rc<CommandBuffer>> const& secondaries);
+
+    // Makes the next submission wait for Other's submission through its pool timeline, Other must be submitted first
+    void WaitFor(rc<CommandBuffer> Other, VkPipelineStageFlags Stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+
     template <class... T>
-    void AddDependency(rc<T>... Resources)
+    void AddDependency(rc<T> const&... Resources)
     {
-        Callbacks.push_back([Resources...]() {
-            (EndResourceDependency(Resources), ...);
-        });
+        (Retained.Retain(Resources, &EndResourceDependency<T>), ...);
+    }
+
+    // Barriers from Image::Transition and Buffer::Transition are collected here and recorded
+    // as a single vkCmdPipelineBarrier2 right before the next command that may depend on them.
+    void AddBarrier(VkImageMemoryBarrier2 const& barrier);
+    void AddBarrier(VkBufferMemoryBarrier2 const& barrier);
+    void FlushBarriers();
+
+#define NOSVK_FLUSH_BARRIERS_BEFORE(Command)                              \
+    template <class... Args>                                              \
+    auto Command(Args&&... args)                                          \
+    {                                                                     \
+        FlushBarriers();                                                  \
+        return VklCommandFunctions::Command(std::forward<Args>(args)...); \
     }
+
+    NOSVK_FLUSH_BARRIERS_BEFORE(Draw)
+    NOSVK_FLUSH_BARRIERS_BEFORE(DrawIndexed)
+    NOSVK_FLUSH_BARRIERS_BEFORE(DrawIndirect)
+    NOSVK_FLUSH_BARRIERS_BEFORE(DrawIndexedIndirect)
+    NOSVK_FLUSH_BARRIERS_BEFORE(Dispatch)
+    NOSVK_FLUSH_BARRIERS_BEFORE(DispatchIndirect)
+    NOSVK_FLUSH_BARRIERS_BEFORE(CopyBuffer)
+    NOSVK_FLUSH_BARRIERS_BEFORE(CopyImage)
+    NOSVK_FLUSH_BARRIERS_BEFORE(CopyBufferToImage)
+    NOSVK_FLUSH_BARRIERS_BEFORE(CopyImageToBuffer)
+    NOSVK_FLUSH_BARRIERS_BEFORE(BlitImage)
+    NOSVK_FLUSH_BARRIERS_BEFORE(ResolveImage)
+    NOSVK_FLUSH_BARRIERS_BEFORE(CopyBuffer2)
+    NOSVK_FLUSH_BARRIERS_BEFORE(CopyImage2)
+    NOSVK_FLUSH_BARRIERS_BEFORE(CopyBufferToImage2)
+    NOSVK_FLUSH_BARRIERS_BEFORE(CopyImageToBuffer2)
+    NOSVK_FLUSH_BARRIERS_BEFORE(BlitImage2)
+    NOSVK_FLUSH_BARRIERS_BEFORE(ResolveImage2)
+    NOSVK_FLUSH_BARRIERS_BEFORE(WriteTimestamp)
+    NOSVK_FLUSH_BARRIERS_BEFORE(WriteTimestamp2)
+    NOSVK_FLUSH_BARRIERS_BEFORE(CopyQueryPoolResults)
+    NOSVK_FLUSH_BARRIERS_BEFORE(UpdateBuffer)
+    NOSVK_FLUSH_BARRIERS_BEFORE(FillBuffer)
+    NOSVK_FLUSH_BARRIERS_BEFORE(ClearColorImage)
+    NOSVK_FLUSH_BARRIERS_BEFORE(ClearDepthStencilImage)
+    NOSVK_FLUSH_BARRIERS_BEFORE(BeginRenderPass)
+    NOSVK_FLUSH_BARRIERS_BEFORE(BeginRendering)
+    NOSVK_FLUSH_BARRIERS_BEFORE(ExecuteCommands)
+    NOSVK_FLUSH_BARRIERS_BEFORE(PipelineBarrier)
+    NOSVK_FLUSH_BARRIERS_BEFORE(PipelineBarrier2)
+#undef NOSVK_FLUSH_BARRIERS_BEFORE
+
 protected:
+    friend struct CommandPool;
+    friend struct Queue;
+    bool InFreeList = false;
+    // Runs PreSubmit callbacks and ends recording, returns false if there is nothing to submit
+    bool PrepareSubmit();
+    std::vector<VkImageMemoryBarrier2> PendingImageBarriers;
+    std::vector<VkBufferMemoryBarrier2> PendingBufferBarriers;
+    friend struct CompletionDispatcher;
+    RetainList Retained;
+    std::vector<rc<CommandBuffer>> Secondaries;
+    rc<Completion> Dispatched; // Clear runs or waits for it so callbacks have run once the buffer is reusable
+    std::weak_ptr<CommandBuffer> Parent; // Primary that executed this secondary
+    rc<vk::Fence> PooledFence; // Owner of Fence, taken from the device fence pool
+    // runEnd is false on the completion thread, see Completion::Run
+    void ReturnToPool(bool runEnd = true);
     VkResult End();
 };
 
 struct nosVulkan_API CommandPool : SharedFactory<CommandPool>
 {
     static constexpr u64 DefaultPoolSize = 256;
+    static constexpr u64 DefaultMaxPoolSize = 1024;
 
     VkCommandPool Handle;
     rc<Queue> PoolQueue;
     std::vector<rc<CommandBuffer>> Buffers;
-    CircularIndex<> NextBuffer;
+
+    // Every submission from this pool signals Timeline with the next value, so completed command buffers
+    // can be retired in submission order with a single counter query instead of polling each fence.
+    VkSemaphore Timeline = VK_NULL_HANDLE;
+    uint64_t LastSubmittedValue = 0;
+    // The pool grows on demand up to this many buffers, after which allocation blocks on the oldest submission.
+    u64 MaxPoolSize = DefaultMaxPoolSize;
+    std::mutex Mutex;
 
     CommandPool(Device* Vk);
+    CommandPool(Device* Vk, QueueType type, u64 PoolSize = DefaultPoolSize);
     CommandPool(Device* Vk, rc<vk::Queue> queue, u64 PoolSize = DefaultPoolSize);
 
     Device* GetDevice();
@@ -100,12 +284,36 @@ struct nosVulkan_API CommandPool : SharedFactory<CommandPool>
     rc<CommandBuffer> AllocCommandBuffer(VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
 
     rc<CommandBuffer> BeginCmd(VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+    // Secondaries must be allocated and recorded on the thread that owns the pool, see Device::GetPool
+    rc<CommandBuffer> BeginSecondaryCmd(const VkCommandBufferInheritanceInfo* inheritance = nullptr,
+                                        VkCommandBufferUsageFlags flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
 
     VkResult Submit(uint32_t submitCount, const VkSubmitInfo* pSubmits, VkFence fence)
     {
         return PoolQueue->Submit(submitCount, pSubmits, fence);
     }
     void Clear();
+
+    uint64_t GetCompletedValue();
+    bool WaitForValue(uint64_t value, uint64_t timeoutNs = UINT64_MAX);
+
+protected:
+    friend struct CommandBuffer;
+    std::vector<rc<CommandBuffer>> FreeBuffers;
+    std::deque<std::pair<uint64_t, rc<CommandBuffer>>> PendingBuffers; // Ordered by timeline value
+
+    // Secondaries returned by primaries of any thread wait in ReturnedSecondaries until the owner thread resets them
+    static constexpr u64 SecondaryGrowCount = 8;
+    std::vector<rc<CommandBuffer>> SecondaryBuffers;
+    std::vector<rc<CommandBuffer>> FreeSecondaries;
+    std::vector<rc<CommandBuffer>> ReturnedSecondaries;
+    std::mutex SecondaryMutex;
+
+    void Grow(u64 count, VkCommandBufferLevel level = VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+    rc<CommandBuffer> AllocSecondary();
+    void ReturnSecondary(rc<CommandBuffer> cmd);
+    void RetireCompleted(uint64_t completedValue);
+    void ReclaimUntracked();
 };
 
 } // namespace nos::vk
\ No newline at end of file
@@ -136,6 +136,12 @@ inline void hash_combine(std::size_t& seed, const T& v, Rest... rest)
 	hash_combine(seed, rest...);
 }
 
+template <class T>
+constexpr T AlignUp(T value, T alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
 template <class T, template <class...> class U>
 struct SpecializationOf : std::false_type
 {
@@ -194,6 +200,18 @@ struct ImageView;
 struct Buffer;
 struct CommandBuffer;
 struct CommandPool;
+struct CompletionDispatcher;
+struct Fence;
+struct DescriptorPool;
+struct DescriptorSet;
+struct BindlessHeap;
+
+enum class QueueType
+{
+    Main,     // Graphics, compute and transfer
+    Compute,  // Dedicated compute family if the device has one
+    Transfer, // Dedicated transfer family if the device has one
+};
 struct QueryPool;
 
 struct DeviceChild
@@ -214,6 +232,40 @@ struct ImageState
     VkImageLayout Layout;
 };
 
+constexpr VkAccessFlags2 WriteAccessMask = VK_ACCESS_2_SHADER_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
+                                           VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+                                           VK_ACCESS_2_TRANSFER_WRITE_BIT | VK_ACCESS_2_HOST_WRITE_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT;
+
+// Anything but a read after read without a layout change needs a barrier from the current state
+inline bool IsBarrierNeeded(VkAccessFlags2 srcAccess, VkAccessFlags2 dstAccess, VkImageLayout srcLayout = VK_IMAGE_LAYOUT_UNDEFINED, VkImageLayout dstLayout = VK_IMAGE_LAYOUT_UNDEFINED)
+{
+    return srcLayout != dstLayout || ((srcAccess | dstAccess) & WriteAccessMask);
+}
+
+// Scope of the last write to a resource. Layout transitions and queue family transfers count as writes
+// performed by their barrier, later readers chain through the barrier's destination stages with no access.
+struct WriteScope
+{
+    VkPipelineStageFlags2 StageMask = 0;
+    VkAccessFlags2 AccessMask = 0;
+};
+
+// Last write after a barrier from src to dst that needed one from the current state
+inline WriteScope GetWriteScope(VkPipelineStageFlags2 srcStage, VkAccessFlags2 srcAccess, VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess)
+{
+    if (dstAccess & WriteAccessMask)
+        return {dstStage, dstAccess & WriteAccessMask};
+    if (srcAccess & WriteAccessMask)
+        return {srcStage, srcAccess & WriteAccessMask};
+    return {dstStage, 0};
+}
+
+// A read after read is only free for the stages and accesses the last barrier already made the write visible to
+inline bool IsReadCovered(VkPipelineStageFlags2 stage, VkAccessFlags2 access, VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess)
+{
+    return !(dstStage & ~stage) && !(dstAccess & ~access);
+}
+
 union DescriptorResourceInfo {
     VkDescriptorImageInfo Image;
     VkDescriptorBufferInfo Buffer;
@@ -411,11 +463,13 @@ nosVulkan_API std::pair<u32, VkMemoryType> MemoryTypeIndex(VkPhysicalDevice phys
 nosVulkan_API void ImageLayoutTransition(VkImage Image,
                                         rc<CommandBuffer> Cmd,
                                         ImageState Src,
-                                        ImageState Dst, VkImageAspectFlags Aspect);
+                                        ImageState Dst, VkImageAspectFlags Aspect,
+                                        u32 SrcFamily = VK_QUEUE_FAMILY_IGNORED, u32 DstFamily = VK_QUEUE_FAMILY_IGNORED);
 nosVulkan_API void ImageLayoutTransition2(VkImage Image,
                                         rc<CommandBuffer> Cmd,
                                         ImageState Src,
-                                        ImageState Dst, VkImageAspectFlags Aspect);
+                                        ImageState Dst, VkImageAspectFlags Aspect,
+                                        u32 SrcFamily = VK_QUEUE_FAMILY_IGNORED, u32 DstFamily = VK_QUEUE_FAMILY_IGNORED);
 
 nosVulkan_API const char* vk_result_string(VkResult re);
 nosVulkan_API const char* descriptor_type_to_string(VkDescriptorType ty);
@@ -0,0 +1,52 @@
+/*
+ * Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+ */
+
+#pragma once
+
+#include "Command.h"
+
+// std
+#include <thread>
+
+namespace nos::vk
+{
+
+// Runs completion work of submitted command buffers on a device level thread instead of the thread that
+// happens to clear them. Every submission is tracked through its pool timeline, the thread blocks on all of
+// them at once with vkWaitSemaphores and hands finished work to the executor.
+struct nosVulkan_API CompletionDispatcher : SharedFactory<CompletionDispatcher>, DeviceChild
+{
+    // Runs a unit of completion work, the default runs it on the dispatcher thread
+    using Executor = std::function<void(std::function<void()>)>;
+
+    CompletionDispatcher(Device* Vk, Executor executor = {});
+    ~CompletionDispatcher();
+
+    // Takes the callbacks, retained resources and secondaries of a submitted command buffer
+    void Track(rc<CommandBuffer> cmd);
+
+protected:
+    struct Entry
+    {
+        VkSemaphore Timeline;
+        u64 Value;
+        rc<CommandBuffer::Completion> Work;
+    };
+
+    void Run();
+    void Wake();
+    void Dispatch(rc<CommandBuffer::Completion> work);
+
+    Executor Exec;
+    std::mutex Mutex;
+    std::vector<Entry> Incoming;
+    std::vector<Entry> Tracked;
+    // Host signaled to wake the thread up for new entries or shutdown
+    VkSemaphore WakeTimeline = VK_NULL_HANDLE;
+    u64 WakeValue = 0;
+    std::atomic_bool Stop = false;
+    std::thread Thread;
+};
+
+} // namespace nos::vk
@@ -10,6 +10,8 @@
 #include "Common.h"
 #include "Allocation.h"
 #include "ResourcePool.hpp"
+#include "StagingRing.h"
+#include "UniformArena.h"
 #include "Platform.h"
 
 // std
@@ -145,6 +147,17 @@ struct nosVulkan_API Device : SharedFactory<Device>,
     VkInstance Instance;
     VkPhysicalDevice PhysicalDevice{};
 	VkPhysicalDeviceMemoryProperties2 MemoryProps{.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2};
+	VkPhysicalDeviceProperties Props{};
+    // VK_KHR_push_descriptor, enabled when the device supports it
+    bool PushDescriptors = false;
+    u32 MaxPushDescriptors = 0;
+    // Update-after-bind and partially bound descriptor arrays, required by the BindlessHeap
+    bool BindlessDescriptors = false;
+    // VK_EXT_descriptor_buffer, opted into when the device is created. Descriptor sets are then written
+    // into the DescriptorRing instead of being allocated from descriptor pools, and push descriptors,
+    // dynamic uniform buffers and the BindlessHeap are not used.
+    bool DescriptorBuffers = false;
+    VkPhysicalDeviceDescriptorBufferPropertiesEXT DescriptorBufferProps{.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_BUFFER_PROPERTIES_EXT};
     VkPipelineCache PipelineCache = {};
     const nos::vk::Context* Context = 0;
 
@@ -152,18 +165,76 @@ struct nosVulkan_API Device : SharedFactory<Device>,
 
     std::map<std::thread::id, std::pair<rc<CommandPool>, rc<QueryPool>>> ImmPools;
 	std::shared_mutex ImmPoolsMutex;
+
+	rc<StagingRing> Staging;
+	std::mutex StagingMutex;
+	rc<UniformArena> Uniforms;
+	std::mutex UniformsMutex;
+	rc<BindlessHeap> Bindless;
+	std::mutex BindlessMutex;
+	rc<StagingRing> DescriptorRing;
+	std::mutex DescriptorRingMutex;
+	rc<CompletionDispatcher> Completions;
+	std::mutex CompletionsMutex;
     
     rc<CommandPool> GetPool();
     rc<QueryPool> GetQPool();
 
+    // Created on first use with StagingRingCapacity bytes
+    VkDeviceSize StagingRingCapacity = StagingRing::DefaultCapacity;
+    rc<StagingRing> GetStagingRing();
+    // Descriptor buffer that bound descriptor sets are copied into, created on first use with
+    // DescriptorRingCapacity bytes, or less if the descriptor buffer ranges are smaller. Grows up to the ranges when full.
+    VkDeviceSize DescriptorRingCapacity = 8ull << 20;
+    rc<StagingRing> GetDescriptorRing();
+    rc<UniformArena> GetUniformArena();
+    // Created on first use, only available when BindlessDescriptors is set
+    rc<BindlessHeap> GetBindlessHeap();
+
 	struct MemoryUsage
 	{
 		size_t Usage;
 		size_t Budget;
 	};
 	MemoryUsage GetCurrentMemoryUsage() const;
+
+	// Once device local usage passes HighWaterMark of the budget, free pool resources are evicted in LRU order
+	// across the image and buffer pools until usage is under LowWaterMark. Free resources outside device local heaps
+	// are left alone. Image and buffer pool Gets check at most once per CheckInterval.
+	// Pressure callbacks run when the pools alone can not get usage under LowWaterMark.
+	struct BudgetGovernor
+	{
+		std::atomic_bool Enabled = false;
+		float HighWaterMark = .9f;
+		float LowWaterMark = .75f;
+		// Only device local evictions are subtracted from the usage estimate, which is re-read every ResyncInterval evictions
+		u32 ResyncInterval = 16;
+		std::chrono::microseconds CheckInterval{1000};
+		std::atomic<std::chrono::steady_clock::rep> NextCheck = 0;
+		std::mutex Mutex;
+		std::mutex CallbacksMutex;
+		std::map<u64, std::function<void(MemoryUsage const&)>> PressureCallbacks;
+		u64 NextCallbackId = 0;
+		// Callbacks run at most once per PressureInterval while usage stays high
+		std::chrono::milliseconds PressureInterval{1000};
+		std::chrono::steady_clock::time_point LastPressure{};
+	} MemoryBudget;
+	void SetMemoryBudget(bool enabled, float highWaterMark = .9f, float lowWaterMark = .75f);
+	u64 AddMemoryPressureCallback(std::function<void(MemoryUsage const&)> callback);
+	void RemoveMemoryPressureCallback(u64 id);
+	void EnforceMemoryBudget();
     
     rc<Queue> MainQueue;
+    // Same as MainQueue when the device has no dedicated family for them
+    rc<Queue> ComputeQueue;
+    rc<Queue> TransferQueue;
+    rc<Queue> GetQueue(QueueType type) const;
+
+    // When set, completion callbacks of submitted command buffers run on its thread.
+    // Stopping it while other threads submit is safe, a submission holding it keeps it alive until it is tracked.
+    void StartCompletionThread(std::function<void(std::function<void()>)> executor = {});
+    void StopCompletionThread();
+    rc<CompletionDispatcher> GetCompletions();
     FeatureSet Features;
     std::unordered_map<std::string, Global> Globals;
     std::vector<std::function<void()>> Callbacks;
@@ -171,6 +242,10 @@ struct nosVulkan_API Device : SharedFactory<Device>,
 
     std::unordered_map<VkSamplerCreateInfo, VkSampler> Samplers;
 
+    // Descriptor pools shared by pipeline layouts with the same descriptor counts, see PipelineLayout::GetSharedPool
+    std::mutex SharedDescriptorPoolsMutex;
+    std::map<std::vector<u32>, rc<DescriptorPool>> SharedDescriptorPools;
+
     std::mutex MemoryBlocksMutex;
     std::unordered_map<VkDeviceMemory, NOS_HANDLE> MemoryBlocks;
 
@@ -180,16 +255,48 @@ struct nosVulkan_API Device : SharedFactory<Device>,
 			MaxUnusedTime = std::chrono::milliseconds(10000);
 			Image = std::make_unique<ImagePool>(device, MaxUnusedTime);
 			Buffer = std::make_unique<BufferPool>(device, MaxUnusedTime);
+			Semaphore = std::make_unique<SemaphorePool>(device, MaxUnusedTime);
+			Fence = std::make_unique<FencePool>(device, MaxUnusedTime);
+			DescriptorSet = std::make_unique<DescriptorSetPool>(device, MaxUnusedTime);
 		}
 		void Clear() {
+			DescriptorSet = nullptr;
 			Image = nullptr;
 			Buffer = nullptr;
+			Semaphore = nullptr;
+			Fence = nullptr;
 		}
 		std::unique_ptr<ImagePool> Image;
 		std::unique_ptr<BufferPool> Buffer;
-		void GarbageCollect() { Image->GarbageCollect(); Buffer->GarbageCollect(); }
+		std::unique_ptr<SemaphorePool> Semaphore;
+		std::unique_ptr<FencePool> Fence;
+		std::unique_ptr<DescriptorSetPool> DescriptorSet;
+		void GarbageCollect()
+		{
+			Image->GarbageCollect(); Buffer->GarbageCollect();
+			Semaphore->GarbageCollect(); Fence->GarbageCollect(); DescriptorSet->GarbageCollect();
+		}
 		std::chrono::milliseconds MaxUnusedTime;
-		void SetMaxUnusedTime(std::chrono::milliseconds ms) { MaxUnusedTime = ms; Image->SetMaxUnusedTime(ms); Buffer->SetMaxUnusedTime(ms); }
+		void SetMaxUnusedTime(std::chrono::milliseconds ms)
+		{
+			MaxUnusedTime = ms;
+			Image->SetMaxUnusedTime(ms); Buffer->SetMaxUnusedTime(ms);
+			Semaphore->SetMaxUnusedTime(ms); Fence->SetMaxUnusedTime(ms); DescriptorSet->SetMaxUnusedTime(ms);
+		}
+		// Peak usage manifests, saved at the end of a session so the next one can start with warm pools
+		bool SaveManifests(std::string const& folder)
+		{
+			bool image = Image->SaveManifest(folder + "/ImagePool.manifest");
+			bool buffer = Buffer->SaveManifest(folder + "/BufferPool.manifest");
+			return image && buffer;
+		}
+		void PrewarmAsync(std::string const& folder)
+		{
+			if (auto manifest = ImagePool::LoadManifest(folder + "/ImagePool.manifest"))
+				Image->PrewarmAsync(std::move(*manifest));
+			if (auto manifest = BufferPool::LoadManifest(folder + "/BufferPool.manifest"))
+				Buffer->PrewarmAsync(std::move(*manifest));
+		}
 	} ResourcePools;
 
     VkSampler GetSampler(VkSamplerCreateInfo const& info);
@@ -290,7 +397,7 @@ struct nosVulkan_API Device : SharedFactory<Device>,
         }
     }
 
-    Device(VkInstance Instance, VkPhysicalDevice PhysicalDevice, const nos::vk::Context* context);
+    Device(VkInstance Instance, VkPhysicalDevice PhysicalDevice, const nos::vk::Context* context, bool descriptorBuffers = false);
     ~Device();
     u64 GetLuid() const;
 
@@ -318,7 +425,8 @@ struct nosVulkan_API Context : SharedFactory<Context>
     std::vector<rc<Device>> Devices;
     std::string CacheFolder;
 
-    rc<Device> CreateDevice(u64 luid) const;
+    // descriptorBuffers selects the VK_EXT_descriptor_buffer backend when the device supports it
+    rc<Device> CreateDevice(u64 luid, bool descriptorBuffers = false) const;
     ~Context();
     Context(DebugCallback* = 0, const char* CacheFolder = nullptr);
     void OrderDevices();
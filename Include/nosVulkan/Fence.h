@@ -0,0 +1,25 @@
+/*
+ * Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+ */
+
+#pragma once
+
+#include "Common.h"
+
+namespace nos::vk
+{
+
+struct nosVulkan_API Fence : SharedFactory<Fence>, DeviceChild
+{
+	VkFence Handle = VK_NULL_HANDLE;
+	Fence(Device* Vk, VkFenceCreateFlags flags = 0);
+
+	VkResult Wait(uint64_t timeoutNs = UINT64_MAX);
+	bool IsSignaled() const;
+	void Reset();
+
+	operator VkFence() const;
+	~Fence();
+};
+
+} // namespace nos::vk
@@ -25,6 +25,8 @@ private:
 public:
     VkImageUsageFlags Usage;
     struct Image* Src;
+    // Slots in the device's BindlessHeap sampled and storage image arrays, assigned on first registration
+    u32 BindlessIndex[2] = {~0u, ~0u};
     ImageView(struct Image* Image, VkFormat Format = VK_FORMAT_UNDEFINED, VkImageUsageFlags Usage = 0);
     ~ImageView();
     DescriptorResourceInfo GetDescriptorInfo(VkFilter) const;
@@ -48,13 +50,22 @@ public:
     VkImageUsageFlags Usage = 0;
 
     ImageState State = {}; // This is not thread safe.
+    WriteScope LastWrite = {}; // Readers State does not cover wait on it
+    // Imported or wrapped images may be written outside this device, so every transition acquires them from VK_QUEUE_FAMILY_EXTERNAL
+    bool ExternallyOwned = false;
     std::map<u64, rc<ImageView>> Views;
 	rc<vk::Semaphore> ExtSemaphore;
 
+    // Called when a pool hands the image to a new user: ownership and layout are reset as if it was just created
+    void DiscardContents();
+
     Image(Device* Vk, ImageCreateInfo const& createInfo, VkResult* re = 0);
 	Image(Device* Vk, VkImage img, VkExtent2D extent, VkFormat format, VkImageUsageFlags usage);
 
     void Transition(rc<CommandBuffer> Cmd, ImageState Dst);
+    // Records the release half of a queue family ownership transfer, Cmd must belong to the owning family.
+    // The acquire half is recorded by the next Transition on the other family, whose command buffer must wait for Cmd.
+    void ReleaseOwnership(rc<CommandBuffer> Cmd, u32 DstFamily);
     void BlitFrom(rc<CommandBuffer> Cmd, rc<Image> Src, VkFilter Filter);
     void CopyFrom(rc<CommandBuffer> Cmd, rc<Image> Src);
     void ResolveFrom(rc<CommandBuffer> Cmd, rc<Image> Src);
@@ -64,10 +75,14 @@ public:
     VkFormat GetFormat() const { return Format; }
     VkExtent2D GetExtent() const { return Extent; }
 
-    void Upload(rc<CommandBuffer> Cmd, rc<Buffer> Src, u32 bufferRowLength = 0, u32 bufferImageHeight = 0);
+    void Upload(rc<CommandBuffer> Cmd, rc<Buffer> Src, u32 bufferRowLength = 0, u32 bufferImageHeight = 0, VkDeviceSize bufferOffset = 0);
+    // Copies data through the device staging ring
+    void Upload(rc<CommandBuffer> Cmd, const void* data, VkDeviceSize size, u32 bufferRowLength = 0, u32 bufferImageHeight = 0);
     rc<Image> Copy(rc<CommandBuffer> Cmd);
     rc<Buffer> Download(rc<CommandBuffer> Cmd);
-    void Download(rc<CommandBuffer> Cmd, rc<Buffer>);
+    void Download(rc<CommandBuffer> Cmd, rc<Buffer>, VkDeviceSize bufferOffset = 0);
+    // Reads back through the device staging ring, OnDownloaded is called after Cmd completes
+    void Download(rc<CommandBuffer> Cmd, std::function<void(const u8* data, u64 size)> OnDownloaded);
     void Clear(rc<CommandBuffer> Cmd, VkClearColorValue value);
 
     ~Image();
@@ -84,6 +99,10 @@ public:
         return GetView(Format, usage); 
     }
 
+    // Index of the default view in the device's BindlessHeap, type is either SAMPLED_IMAGE or STORAGE_IMAGE.
+    // Cmd retains the image, so the slot is not handed out again before the shaders indexing it complete.
+    u32 GetBindlessIndex(rc<CommandBuffer> Cmd, VkDescriptorType type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE);
+
     VkImageAspectFlags GetAspect() const
     {
         return (Format == VK_FORMAT_D32_SFLOAT) ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
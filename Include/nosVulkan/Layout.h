@@ -18,9 +18,14 @@ struct nosVulkan_API DescriptorLayout : SharedFactory<DescriptorLayout>, DeviceC
 {
     std::map<u32, NamedDSLBinding> Bindings;
     VkDescriptorSetLayout Handle;
+    VkDescriptorSetLayoutCreateFlags Flags = 0;
     u32 MaxDescriptors = 0;
+    // With descriptor buffers, the size of a set's descriptors and where each binding starts in it
+    VkDeviceSize DescriptorBufferSize = 0;
+    std::map<u32, VkDeviceSize> DescriptorBufferOffsets;
     NamedDSLBinding const& operator[](u32 binding) const;
-    DescriptorLayout(Device* Vk, std::map<u32, NamedDSLBinding> NamedBindings);
+    // BindingFlags are applied to every binding through VkDescriptorSetLayoutBindingFlagsCreateInfo
+    DescriptorLayout(Device* Vk, std::map<u32, NamedDSLBinding> NamedBindings, VkDescriptorSetLayoutCreateFlags Flags = 0, VkDescriptorBindingFlags BindingFlags = 0);
     ~DescriptorLayout();
 
     auto begin() const
@@ -34,36 +39,90 @@ struct nosVulkan_API DescriptorLayout : SharedFactory<DescriptorLayout>, DeviceC
     }
 };
 
-struct nosVulkan_API DescriptorPool : SharedFactory<DescriptorPool>
+struct nosVulkan_API DescriptorPool : SharedFactory<DescriptorPool>, DeviceChild
 {
     std::mutex Mutex;
+    // Null for pools shared between layouts, AllocateSet then needs the set's layout
     rc<struct PipelineLayout> Layout;
     VkDescriptorPool Handle;
     std::vector<VkDescriptorPoolSize> Sizes;
+    // Sets and descriptors of one group of the layout's sets, Sizes holds Capacity groups
+    u32 GroupSetCount = 0;
+    std::vector<VkDescriptorPoolSize> GroupSizes;
     std::atomic_uint InUse = 0;
     std::atomic_uint MaxSets = 0;
-    DescriptorPool(rc<PipelineLayout> Layout);
-    DescriptorPool(rc<PipelineLayout> Layout, std::vector<VkDescriptorPoolSize> Sizes);
+    std::atomic_uint PeakInUse = 0; // High-water mark of InUse
+    // Created without FREE_DESCRIPTOR_SET_BIT, sets are never freed one by one and the whole pool is reset instead
+    bool Linear = false;
+    // Number of full groups of the layout's sets the pool is sized for. Pools start at the layout's
+    // PoolCapacityHint and each chained pool doubles its predecessor, up to MaxCapacity.
+    u32 Capacity = 0;
+    static constexpr u32 InitialCapacity = 4;
+    static constexpr u32 MaxCapacity = 1024;
+    DescriptorPool(rc<PipelineLayout> Layout, bool Linear = false, u32 Capacity = 0);
+    // Pool for sets of any layout with these counts, without keeping a layout alive
+    DescriptorPool(Device* Vk, u32 GroupSetCount, std::vector<VkDescriptorPoolSize> GroupSizes, bool Linear = false, u32 Capacity = InitialCapacity);
     ~DescriptorPool();
+    // Links of the chain, guarded by ChainMutex which every pool of the chain shares.
+    // An emptied pool other than the head leaves the chain.
     rc<DescriptorPool> Next = 0;
     DescriptorPool* Prev = 0;
-    rc<struct DescriptorSet> AllocateSet(u32 set);
+    rc<std::mutex> ChainMutex = std::make_shared<std::mutex>();
+    // Allocates a set of setLayout (the pool's layout when null), chaining a larger pool when this one is exhausted
+    rc<struct DescriptorSet> AllocateSet(u32 set, rc<PipelineLayout> setLayout = nullptr);
+    // Same without chaining, null when this pool is exhausted
+    rc<struct DescriptorSet> TryAllocateSet(u32 set, rc<PipelineLayout> setLayout = nullptr);
+    // Linear pools only, invalidates every set allocated from the pool
+    void Reset();
+
+private:
+    void CreateHandle();
+    rc<DescriptorSet> AllocateUnlocked(u32 set, rc<PipelineLayout> const& setLayout);
+};
+
+// Hands out sets from linear pools that are reset with a single vkResetDescriptorPool instead of freeing each set.
+// A pool is retired when full and reset once every command buffer that allocated from it has completed.
+// Sets are only valid for the recording of the command buffer they were allocated for.
+struct nosVulkan_API FrameDescriptorPool : SharedFactory<FrameDescriptorPool>
+{
+    FrameDescriptorPool(rc<struct PipelineLayout> Layout);
+    rc<struct DescriptorSet> AllocateSet(u32 set, rc<CommandBuffer> const& cmd);
+
+private:
+    struct Page
+    {
+        rc<DescriptorPool> Pool;
+        std::shared_ptr<std::atomic_uint> Pending = std::make_shared<std::atomic_uint>(0); // Command buffers not yet completed
+        u64 LastRecording = 0; // CommandBuffer::RecordingEpoch that last allocated from the page
+    };
+    rc<PipelineLayout> Layout;
+    std::mutex Mutex;
+    Page Current;
+    std::vector<Page> Retired;
+    Page NextPage(u32 capacity = 0);
 };
 
 struct nosVulkan_API DescriptorSet : SharedFactory<DescriptorSet>
 {
     rc<DescriptorPool> Pool;
+    rc<struct PipelineLayout> Owner; // Pipeline layout the set was allocated for, pools can be shared between layouts
     DescriptorLayout* Layout;
     u32 Index;
     VkDescriptorSet Handle;
+    // Descriptor buffer sets have no pool or handle, Update writes their descriptors here
+    // and they are copied into the device's DescriptorRing on every bind
+    std::vector<u8> DescriptorData;
     // std::unordered_map<rc<Image>, ImageState> BindStates;
-    DescriptorSet(rc<DescriptorPool>, u32 Index);
+    // Takes over a handle allocated from pool by DescriptorPool::AllocateSet
+    DescriptorSet(rc<DescriptorPool>, rc<PipelineLayout> Owner, u32 Index, VkDescriptorSet Handle);
+    // Descriptor buffer set, only when the device uses descriptor buffers
+    DescriptorSet(rc<PipelineLayout> Owner, u32 Index);
     ~DescriptorSet();
     VkDescriptorType GetType(u32 Binding);
 
     void Update(std::set<Binding> const& res);
     void Write(Binding const& res, DescriptorResourceInfo* info, VkWriteDescriptorSet* write);
-    void Bind(rc<CommandBuffer> Cmd, VkPipelineBindPoint BindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS);
+    void Bind(rc<CommandBuffer> Cmd, VkPipelineBindPoint BindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS, std::vector<u32> const& DynamicOffsets = {});
 };
 
 struct nosVulkan_API PipelineLayout : SharedFactory<PipelineLayout>, DeviceChild
@@ -74,6 +133,32 @@ struct nosVulkan_API PipelineLayout : SharedFactory<PipelineLayout>, DeviceChild
     u32 RTCount = 1;
     u32 UniformSize = 0;
 
+    // Uniform blocks are copied into a single UniformArena allocation on every bind
+    struct UniformBlock
+    {
+        u32 Set;
+        u32 Binding;
+        u32 DataOffset;  // Same as OffsetMap
+        u32 Size;
+        u32 ArenaOffset; // Aligned to minUniformBufferOffsetAlignment
+    };
+    std::vector<UniformBlock> UniformBlocks; // Ordered by set, then binding
+    u32 UniformArenaSize = 0;
+    // Uniform buffers are declared as VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC unless the layout
+    // needs more than maxDescriptorSetUniformBuffersDynamic of them
+    bool DynamicUniforms = false;
+    // With VK_KHR_push_descriptor, the first set that fits in maxPushDescriptors and has no runtime arrays
+    // is recorded with PushDescriptorSet instead of being allocated. Its uniform buffers are never dynamic.
+    u32 PushSet = ~0u;
+    // Set declaring the BindlessHeap arrays, bound to the device's heap set instead of being allocated
+    u32 BindlessSet = ~0u;
+    // Sets that are allocated from descriptor pools
+    u32 PooledSetCount() const;
+    void PushDescriptorSet(rc<CommandBuffer> Cmd, VkPipelineBindPoint BindPoint, u32 Set, std::set<Binding> const& Resources);
+    // Copies the descriptor buffer sets into one DescriptorRing range and points the sets at it.
+    // The ring is bound once per command buffer, so binding a single set keeps the offsets of the others.
+    void BindDescriptorBuffers(rc<CommandBuffer> Cmd, VkPipelineBindPoint BindPoint, std::vector<rc<DescriptorSet>> const& Sets);
+
     std::map<u64, u32> OffsetMap;
 	std::map<u64, u32> SizeMap; // For storage buffers
     std::map<u32, rc<DescriptorLayout>> DescriptorLayouts;
@@ -82,6 +167,11 @@ struct nosVulkan_API PipelineLayout : SharedFactory<PipelineLayout>, DeviceChild
     ~PipelineLayout();
     
     rc<DescriptorPool> CreatePool();
+    rc<FrameDescriptorPool> CreateFramePool();
+    // Pool shared by every layout with the same descriptor counts, for passes that allocate few sets
+    rc<DescriptorPool> GetSharedPool();
+    // Capacity new pools of this layout start with, raised whenever a pool chain has to grow
+    std::atomic_uint PoolCapacityHint = DescriptorPool::InitialCapacity;
 
     void Dump();
 
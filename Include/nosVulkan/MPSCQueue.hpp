@@ -0,0 +1,65 @@
+// Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+
+#pragma once
+
+// std
+#include <atomic>
+#include <utility>
+
+namespace nos::vk
+{
+
+// Unbounded multi producer single consumer queue.
+// Push is wait free and can be called from any thread, TryPop and Empty must only be called by the consumer.
+// A pop can briefly miss an element whose push has not finished linking it yet.
+template <typename T>
+class MPSCQueue
+{
+public:
+	MPSCQueue() : Head(new Node), Tail(Head.load(std::memory_order_relaxed)) {}
+	MPSCQueue(MPSCQueue const&) = delete;
+	MPSCQueue& operator=(MPSCQueue const&) = delete;
+
+	~MPSCQueue()
+	{
+		T discard;
+		while (TryPop(discard))
+			;
+		delete Tail;
+	}
+
+	void Push(T value)
+	{
+		Node* node = new Node{.Value = std::move(value)};
+		Node* prev = Head.exchange(node, std::memory_order_acq_rel);
+		prev->Next.store(node, std::memory_order_release);
+	}
+
+	bool TryPop(T& out)
+	{
+		Node* next = Tail->Next.load(std::memory_order_acquire);
+		if (!next)
+			return false;
+		out = std::move(next->Value);
+		delete Tail;
+		Tail = next;
+		return true;
+	}
+
+	bool Empty() const
+	{
+		return Head.load(std::memory_order_acquire) == Tail;
+	}
+
+private:
+	struct Node
+	{
+		std::atomic<Node*> Next = nullptr;
+		T Value;
+	};
+
+	std::atomic<Node*> Head;
+	Node* Tail;
+};
+
+} // namespace nos::vk
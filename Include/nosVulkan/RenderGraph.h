@@ -0,0 +1,116 @@
+/*
+ * Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+ */
+
+#pragma once
+
+#include "Renderpass.h"
+
+// std
+#include <deque>
+
+namespace nos::vk
+{
+
+// Frame graph over Renderpass and Computepass.
+// Passes name the resources they use by shader binding name and whether each use reads or writes
+// is taken from the pipeline reflection. Compile culls passes that do not contribute to an imported
+// or output resource, and maps transient images onto pooled images: transients with identical create
+// infos and disjoint lifetimes share one image. Execute records the passes in declaration order.
+// Before a pass is bound, every image and buffer it reads or writes, including its attachments, is
+// transitioned to the state the pass uses, so the barriers of a pass are flushed as one batch.
+struct nosVulkan_API RenderGraph : SharedFactory<RenderGraph>, DeviceChild
+{
+    using ResourceId = u32;
+    static constexpr ResourceId InvalidResource = ~0u;
+
+    struct nosVulkan_API PassDesc
+    {
+        std::string Name;
+        rc<Renderpass> RP;
+        rc<Computepass> CP;
+        std::map<std::string, std::pair<ResourceId, VkFilter>> Images;
+        std::map<std::string, ResourceId> Buffers;
+        ResourceId ColorTarget = InvalidResource;
+        ResourceId DepthTarget = InvalidResource;
+        Renderpass::ExecPassInfo ExecInfo = {};
+        VkExtent3D GroupCount = {8, 8, 1};
+        // Called with the pass locked before its resources are bound, e.g. to BindData
+        std::function<void(Basepass&)> Setup;
+
+        PassDesc& Bind(std::string const& name, ResourceId res, VkFilter filter = VK_FILTER_LINEAR);
+        PassDesc& BindBuffer(std::string const& name, ResourceId res);
+        PassDesc& SetDepth(ResourceId res, bool clear = true, float clearValue = 1.f);
+        PassDesc& OnSetup(std::function<void(Basepass&)> fn);
+
+        Basepass* GetPass() const { return RP ? (Basepass*)RP.get() : (Basepass*)CP.get(); }
+
+        // Filled by Compile
+        std::vector<ResourceId> Reads;
+        std::vector<ResourceId> Writes;
+        bool Culled = false;
+    };
+
+    RenderGraph(Device* Vk);
+    ~RenderGraph();
+
+    ResourceId Import(rc<Image> image, std::string name = "");
+    ResourceId Import(rc<Buffer> buffer, std::string name = "");
+    ResourceId CreateImage(ImageCreateInfo const& info, std::string name);
+    // Keeps the writers of a transient alive. Its image stays out of the pool after Execute until it is taken
+    // with TakeImage, or released by the next Execute, Compile or Reset.
+    void MarkOutput(ResourceId res);
+
+    PassDesc& AddRenderpass(std::string name, rc<Renderpass> pass, ResourceId colorTarget);
+    PassDesc& AddComputepass(std::string name, rc<Computepass> pass, u32 x = 8, u32 y = 8, u32 z = 1);
+
+    void Compile();
+    void Execute(rc<CommandBuffer> Cmd);
+    void Reset();
+
+    // Images of transients that are not outputs return to the pool at the end of Execute, they are only
+    // valid for commands recorded into the executing command buffer
+    rc<Image> GetImage(ResourceId res) const;
+    // Hands the image of an output over to the caller, who releases it to the image pool when done
+    rc<Image> TakeImage(ResourceId res);
+    rc<Buffer> GetBuffer(ResourceId res) const;
+    bool IsCulled(std::string const& passName) const;
+    u32 GetTransientImageCount() const { return (u32)Slots.size(); }
+
+protected:
+    struct Resource
+    {
+        std::string Name;
+        rc<vk::Image> Image;
+        rc<vk::Buffer> Buffer;
+        std::optional<ImageCreateInfo> TransientInfo;
+        bool Output = false;
+
+        // Filled by Compile
+        u32 FirstUse = ~0u;
+        u32 LastUse = 0;
+        u32 Slot = ~0u;
+    };
+
+    struct TransientSlot
+    {
+        ImageCreateInfo Info;
+        u32 LastUse;
+        std::string Name;
+        rc<vk::Image> Image;
+        bool Output = false;
+    };
+
+    std::vector<Resource> Resources;
+    std::deque<PassDesc> Passes;
+    std::vector<TransientSlot> Slots;
+    bool Compiled = false;
+    // The last Execute, untaken outputs go back to the pool once it completes
+    rc<CommandBuffer> OutputCmd;
+
+    void CollectAccesses(PassDesc& pass);
+    void ScheduleBarriers(PassDesc& pass, rc<CommandBuffer> Cmd);
+    void ReleaseOutputs();
+};
+
+} // namespace nos::vk
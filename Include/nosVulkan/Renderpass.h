@@ -32,16 +32,20 @@ struct nosVulkan_API Basepass :  DeviceChild
     rc<DescriptorPool> PassDescriptorPool;
     std::vector<rc<DescriptorSet>> DescriptorSets;
     std::map<u32, std::set<vk::Binding>> Bindings;
-    rc<Buffer> UniformBuffer;
-	rc<Buffer> CreateUniformSizedBuffer();
+    // CPU copy of the uniform blocks, uploaded to the device uniform arena on every BindResources
+    std::vector<u8> UniformData;
+    std::map<u32, std::vector<u32>> DynamicOffsets;
+    // Uniforms no longer live in a per pass buffer, kept for callers that still create one themselves
+    [[deprecated("Uniforms are uploaded to the device UniformArena, see UploadUniforms")]]
+    rc<Buffer> CreateUniformSizedBuffer();
     rc<Buffer> CreateStorageBuffer(u64 size);
-    bool UniformBufferDirty = false;
     // Storage buffers that are created internally (read-only)
     // These are not used as nos.fb.vulkan.Buffer
     // Bool is for dirty check
     std::map < u64, std::pair < rc<Buffer>, bool >> StorageBuffers;
 
     Basepass(rc<Pipeline> PL);
+    ~Basepass();
 
     void Lock() { Mutex.lock(); }
     void Unlock() { Mutex.unlock(); }
@@ -100,10 +104,41 @@ struct nosVulkan_API Basepass :  DeviceChild
     void TransitionInput(rc<vk::CommandBuffer> Cmd, std::string const& name, rc<Image>);
 	void TransitionInput(rc<vk::CommandBuffer> cmd, std::string const& name, rc<Buffer>);
 
-    void RefreshBuffer(rc<vk::CommandBuffer> Cmd);
+    void UploadUniforms(rc<vk::CommandBuffer> Cmd);
+    [[deprecated("Use UploadUniforms")]]
+    void RefreshBuffer(rc<vk::CommandBuffer> Cmd) { UploadUniforms(Cmd); }
     void BindResources(rc<vk::CommandBuffer> Cmd);
 
-    void UpdateDescriptorSets();
+    // Sets that are not cached are allocated for Cmd when given, see SetFrameScopedDescriptors
+    void UpdateDescriptorSets(rc<vk::CommandBuffer> Cmd = nullptr);
+
+    // Off by default. When enabled, sets that are not cached come from linear pools that are reset once the
+    // command buffers using them complete, instead of being freed one by one.
+    void SetFrameScopedDescriptors(bool enabled);
+    rc<FrameDescriptorPool> FrameDescriptors;
+
+    // Written descriptor sets keyed by the contents of their bindings. An entry is reused as long as
+    // none of its resources were destroyed or returned to a ResourcePool since it was written.
+    struct CachedDescriptorSet
+    {
+        rc<DescriptorSet> Set;
+        std::vector<u8> Key;
+        std::vector<std::weak_ptr<void>> Resources;
+        u64 LastUse = 0;
+        bool IsValid() const;
+    };
+    static constexpr u32 MaxCachedDescriptorSets = 64;
+    std::unordered_map<u64, CachedDescriptorSet> DescriptorSetCache;
+    u64 DescriptorSetCacheClock = 0;
+    rc<DescriptorSet> GetDescriptorSet(u32 set, std::set<vk::Binding> const& bindings, rc<vk::CommandBuffer> const& Cmd = nullptr);
+    void EvictDescriptorSet();
+    // Uncached sets taken from the device descriptor set pool, released to the command buffer that binds them
+    std::vector<rc<DescriptorSet>> PooledDescriptorSets;
+    // Passes allocate from their layout's shared pool until they request HotPassAllocations sets, then get their own
+    static constexpr u32 HotPassAllocations = 64;
+    u32 DescriptorAllocations = 0;
+    bool OwnsDescriptorPool = false;
+    void CountDescriptorAllocation();
 };
 
 struct nosVulkan_API Computepass : SharedFactory<Computepass>, Basepass
@@ -138,10 +173,15 @@ struct nosVulkan_API Renderpass : SharedFactory<Renderpass>, Basepass
 		u64 FrameNumber = 0;
 		float DeltaSeconds = .0f;
 		std::array<float, 4> ClearCol = {0.0f};
+		// The pass is drawn by secondaries from BeginSecondary, executed into the primary with CommandBuffer::Execute
+		bool SecondaryContents = false;
     };
 
     rc<GraphicsPipeline> GetPL() const { return ((GraphicsPipeline*)PL.get())->shared_from_this(); }
 	void Begin(rc<CommandBuffer> cmd, const BeginPassInfo& info);
+    // Begins a secondary from pool that continues the render pass started by Begin with SecondaryContents set.
+    // The pass must not be modified while secondaries are recorded on other threads.
+    rc<CommandBuffer> BeginSecondary(rc<CommandPool> pool, const BeginPassInfo& info);
     void End(rc<CommandBuffer> Cmd);
 	struct ExecPassInfo
 	{
@@ -150,5 +190,8 @@ struct nosVulkan_API Renderpass : SharedFactory<Renderpass>, Basepass
 	};
     void Exec(rc<vk::CommandBuffer> Cmd, const ExecPassInfo& info);
     void Draw(rc<vk::CommandBuffer> Cmd, const VertexData* Verts = 0);
+
+protected:
+    void SetupDrawState(rc<CommandBuffer> cmd, const BeginPassInfo& info, rc<ImageView> img);
 };
 }
\ No newline at end of file
@@ -6,17 +6,76 @@
 #include <nosVulkan/Common.h>
 #include <nosVulkan/Image.h>
 #include <nosVulkan/Buffer.h>
+#include <nosVulkan/Command.h>
+#include <nosVulkan/Fence.h>
 
 // std
 #include <unordered_map>
 #include <shared_mutex>
 #include <list>
+#include <thread>
+#include <condition_variable>
+#include <optional>
+#include <array>
+#include <atomic>
+#include <fstream>
+#include <algorithm>
+
 namespace nos::vk
 {
 
+namespace detail
+{
+nosVulkan_API uint64_t GetTimelineValue(vk::Device* device, VkSemaphore timeline);
+// Lets the device evict pooled resources before a pool allocates, see Device::EnforceMemoryBudget
+nosVulkan_API void CheckMemoryBudget(vk::Device* device);
+// Reads and writes creation infos in pool usage manifests, specialized below for each pooled creation info
+template <typename CreationInfoT>
+struct CreationInfoSerializer;
+}
+
+// Adapts a type to ResourcePool, the defaults fit types with a Handle and a Size like Image and Buffer
+template <typename ResourceT, typename CreationInfoT>
+struct ResourcePoolTraits
+{
+	static rc<ResourceT> Create(vk::Device* device, CreationInfoT const& info)
+	{
+		return ResourceT::New(device, info);
+	}
+
+	// Identifies a used resource in Release
+	static uint64_t GetKey(ResourceT const& res)
+	{
+		if constexpr (requires { res.Handle; })
+			return uint64_t(res.Handle);
+		else
+			return uint64_t(&res);
+	}
+
+	static uint64_t GetSize(ResourceT const& res)
+	{
+		if constexpr (requires { res.Size; })
+			return res.Size;
+		else
+			return 0;
+	}
+
+	// Prepares a released resource for its next user, returning false destroys it instead
+	static bool Recycle(ResourceT& res, CreationInfoT const& info)
+	{
+		if constexpr (requires { res.Generation; })
+			res.Generation++;
+		// The previous user's queue family and layout would make the next one record an acquire without a release
+		if constexpr (requires { res.DiscardContents(); })
+			res.DiscardContents();
+		return true;
+	}
+};
+
 template <typename ResourceT, typename CreationInfoT,
 		  typename CreationInfoHasherT = std::hash<CreationInfoT>,
-		  typename CreationInfoEqualsT = std::equal_to<CreationInfoT>>
+		  typename CreationInfoEqualsT = std::equal_to<CreationInfoT>,
+		  typename TraitsT = ResourcePoolTraits<ResourceT, CreationInfoT>>
 class ResourcePool
 {
 public:
@@ -34,165 +93,1039 @@ public:
 	using FreeList = std::list<rc<ResourceT>>;
 	using FreeMap = MapWithCreationInfoAsKey<FreeList>;
 
+	// Every free resource of a shard has an entry in one list ordered by release, its free slot points back to it.
+	// Slots of one creation info are in release order as well: releases append, Get takes the newest and
+	// eviction the oldest, so the front slot of a creation info always belongs to its oldest entry.
+	struct LruEntry
+	{
+		std::chrono::steady_clock::time_point Released;
+		CreationInfoT CreationInfo;
+	};
+	using LruList = std::list<LruEntry>;
+	using FreeSlots = std::list<std::pair<rc<ResourceT>, typename LruList::iterator>>;
+	using FreeSlotMap = MapWithCreationInfoAsKey<FreeSlots>;
+
+	// Released resources whose last GPU use has not completed yet
+	struct DeferredResourceInfo
+	{
+		std::string Tag;
+		CreationInfoT CreationInfo;
+		rc<ResourceT> Resource;
+		CommandBuffer* Cmd = nullptr; // Set when released to a command buffer, reusable within it right away
+		VkSemaphore Timeline = VK_NULL_HANDLE;
+		uint64_t Value = 0;
+		uint64_t Token = 0;
+	};
+	using DeferredMap = std::unordered_map<uint64_t, DeferredResourceInfo>;
+
+	// Peak number of resources of each creation info that were in use or waiting for the GPU at the same time
+	using Manifest = std::vector<std::pair<CreationInfoT, uint64_t>>;
+
+	// Counters since creation, read without locking any of the pool's maps
+	struct Stats
+	{
+		uint64_t Hits = 0;		  // Gets served with an existing resource
+		uint64_t Misses = 0;	  // Gets that created a resource
+		uint64_t Evictions = 0;	  // Free resources destroyed by expiry, memory pressure or GarbageCollect
+		uint64_t EvictedBytes = 0;
+		std::chrono::nanoseconds TotalAllocationTime{};
+		std::chrono::nanoseconds MaxAllocationTime{};
+		uint64_t AvailableCount = 0;
+		uint64_t UsedCount = 0;
+		uint64_t ReadyBytes = 0;
+		uint64_t UsedBytes = 0;
+	};
+
+	// Bytes of used resources with a tag
+	struct TagStats
+	{
+		std::string Tag;
+		uint64_t Count = 0;
+		uint64_t LiveBytes = 0;
+		uint64_t PeakBytes = 0;
+	};
+
+	// Free lists are sharded by creation info hash and used resources by handle, each shard has its own lock
+	static constexpr uint32_t ShardCount = 16;
+	// Threads hash onto cache slots that keep their last few released resources out of the shards
+	static constexpr uint32_t CacheSlotCount = 16;
+	static constexpr uint32_t CacheSlotSize = 4;
+	// Upper bound of resources destroyed by one CheckAndClean call
+	static constexpr uint32_t MaxEvictionsPerCall = 4;
+
 	ResourcePool(vk::Device* device, std::chrono::milliseconds maxUnusedTime)
 		: Device(device), MaxUnusedTime(maxUnusedTime) {}
+
+	virtual ~ResourcePool()
+	{
+		StopPrewarm();
+		StopEvictionThread();
+	}
 	
 	rc<ResourceT> Get(CreationInfoT const& info, std::string tag)
 	{
-		std::unique_lock guard(Mutex);
-		auto freeIt = Free.find(info);
-		if (freeIt == Free.end() || freeIt->second.empty())
+		CheckMemoryBudget();
+		CollectDeferred();
+		return GetAvailable(AdjustCreationInfo(info), std::move(tag));
+	}
+
+	// Also reuses resources released to cmd, recorded work on them is ordered by cmd itself
+	rc<ResourceT> Get(CreationInfoT const& info, std::string tag, rc<CommandBuffer> const& cmd)
+	{
+		CheckMemoryBudget();
+		CollectDeferred();
+		auto adjusted = AdjustCreationInfo(info);
+		if (cmd)
 		{
-			auto res = ResourceT::New(Device, info); //was typename
-			if (!res)
-				return nullptr;
-			Used[uint64_t(res->Handle)] = { tag, info, res };
-			UsedResourceMemoryUsage += res->Size;
-			CheckAndClean();
-			return res;
+			CreationInfoEqualsT equals;
+			std::unique_lock guard(DeferredMutex);
+			for (auto it = Deferred.begin(); it != Deferred.end(); ++it)
+			{
+				if (it->second.Cmd != cmd.get() || !equals(it->second.CreationInfo, adjusted))
+					continue;
+				auto res = std::move(it->second.Resource);
+				Deferred.erase(it);
+				guard.unlock();
+				// A new user, but not Recycle: discarding the state would drop the barriers against
+				// the previous user's work recorded earlier in cmd
+				if constexpr (requires { res->Generation; })
+					res->Generation++;
+				++Hits;
+				AddUsed(res, adjusted, std::move(tag));
+				return res;
+			}
 		}
-		auto& freeList = freeIt->second;
-		auto res = freeList.back();
-		freeList.pop_back();
-		ReadyResourceMemoryUsage -= res->Size;
-		if (freeList.empty())
-			Free.erase(freeIt);
-		Used[uint64_t(res->Handle)] = { tag, info, res };
-		UsedResourceMemoryUsage += res->Size;
-		CheckAndClean();
-		return res;
+		return GetAvailable(adjusted, std::move(tag));
 	}
 
 	bool Release(uint64_t handle)
 	{
-		std::unique_lock guard(Mutex);
-		auto usedIt = Used.find(handle);
-		if (usedIt == Used.end())
+		auto used = TakeUsed(handle);
+		if (!used)
 			return false;
-		auto [tag, info, res] = usedIt->second;
-		auto size = res->Size;
-		Used.erase(usedIt);
-		UsedResourceMemoryUsage -= size;
-		Free[info].push_back(std::move(res));
-		ReleaseTime[info] = std::chrono::steady_clock::now();
-		ReadyResourceMemoryUsage += size;
+		if (!PutCached(used->CreationInfo, used->Resource))
+			MakeFree(used->CreationInfo, std::move(used->Resource));
 		CheckAndClean();
 		return true;
 	}
 
+	bool Release(rc<ResourceT> const& res)
+	{
+		return res && Release(TraitsT::GetKey(*res));
+	}
+
+	// The resource becomes reusable once cmd completes. Until then only Get with the same cmd can take it.
+	bool Release(uint64_t handle, rc<CommandBuffer> const& cmd)
+	{
+		if (!cmd)
+			return Release(handle);
+		switch (cmd->State.load())
+		{
+		case CommandBuffer::Recording:
+		case CommandBuffer::Executable:
+			break;
+		// Submitted buffers may be running their callbacks already, their timeline value is final
+		case CommandBuffer::Pending:
+			if (cmd->Pool && cmd->SubmitValue)
+				return Release(handle, cmd->Pool->Timeline, cmd->SubmitValue);
+			break;
+		default:
+			return Release(handle);
+		}
+		auto used = TakeUsed(handle);
+		if (!used)
+			return false;
+		uint64_t token;
+		{
+			std::unique_lock guard(DeferredMutex);
+			token = ++DeferredToken;
+			Deferred[handle] = { std::move(used->Tag), std::move(used->CreationInfo), std::move(used->Resource), cmd.get(), VK_NULL_HANDLE, 0, token };
+		}
+		cmd->Callbacks.push_back([this, handle, token]() { CompleteDeferred(handle, token); });
+		return true;
+	}
+
+	// The resource becomes reusable once timeline reaches value
+	bool Release(uint64_t handle, VkSemaphore timeline, uint64_t value)
+	{
+		auto used = TakeUsed(handle);
+		if (!used)
+			return false;
+		std::unique_lock guard(DeferredMutex);
+		Deferred[handle] = { std::move(used->Tag), std::move(used->CreationInfo), std::move(used->Resource), nullptr, timeline, value, ++DeferredToken };
+		++TimelineDeferredCount;
+		return true;
+	}
+
+	// Destroys at most MaxEvictionsPerCall resources of one shard that have been free for longer than MaxUnusedTime.
+	// Does nothing while the eviction thread runs, it takes over this work.
 	virtual void CheckAndClean()
 	{
-		auto now = std::chrono::steady_clock::now();
-		for (auto it = ReleaseTime.begin(); it != ReleaseTime.end();)
+		if (EvictionRunning)
+			return;
+		SpillCache(GetCacheSlot(), false, true);
+		std::vector<rc<ResourceT>> evicted;
+		auto& shard = FreeShards[NextCleanShard++ % ShardCount];
 		{
-			auto& [info, released] = *it;
-			auto fit = Free.find(info);
-			if (fit != Free.end() && now - released > MaxUnusedTime)
+			std::unique_lock lock(shard.Mutex, std::try_to_lock);
+			if (!lock)
+				return;
+			EvictExpired(shard, MaxEvictionsPerCall, evicted);
+		}
+	}
+
+	// Evicts expired resources every period on a background thread instead of the callers of Get and Release
+	void StartEvictionThread(std::chrono::milliseconds period = std::chrono::milliseconds(500))
+	{
+		std::unique_lock lock(EvictionMutex);
+		if (EvictionThread.joinable())
+			return;
+		StopEviction = false;
+		EvictionRunning = true;
+		EvictionThread = std::thread([this, period] {
+			std::unique_lock lock(EvictionMutex);
+			while (!EvictionCondition.wait_for(lock, period, [this] { return StopEviction; }))
 			{
-				auto& freeList = fit->second;
-				while (!freeList.empty())
+				lock.unlock();
+				for (auto& slot : CacheSlots)
+					SpillCache(slot, false, true);
+				std::vector<rc<ResourceT>> evicted;
+				for (auto& shard : FreeShards)
 				{
-					ReadyResourceMemoryUsage -= freeList.front()->Size;
-					freeList.pop_front();
+					std::unique_lock guard(shard.Mutex);
+					EvictExpired(shard, UINT32_MAX, evicted);
 				}
-				Free.erase(fit);
-				it = ReleaseTime.erase(it);
+				evicted.clear();
+				lock.lock();
 			}
-			else
-				++it;
+		});
+	}
+
+	/// Release time of the least recently released free resource that sizeOf measures as non-zero
+	std::optional<std::chrono::steady_clock::time_point> GetOldestReleaseTime(uint64_t (*sizeOf)(ResourceT const&) = &TraitsT::GetSize)
+	{
+		for (auto& slot : CacheSlots)
+			SpillCache(slot, true, false);
+		std::optional<std::chrono::steady_clock::time_point> oldest;
+		for (auto& shard : FreeShards)
+		{
+			std::unique_lock guard(shard.Mutex);
+			if (auto slot = FindOldestLocked(shard, sizeOf); slot && (!oldest || slot->second->second->Released < *oldest))
+				oldest = slot->second->second->Released;
+		}
+		return oldest;
+	}
+
+	/// Destroys the least recently released free resource that sizeOf measures as non-zero regardless of its age,
+	/// returns its size. The rest are skipped rather than destroyed for nothing.
+	uint64_t EvictOldest(uint64_t (*sizeOf)(ResourceT const&) = &TraitsT::GetSize)
+	{
+		for (auto& slot : CacheSlots)
+			SpillCache(slot, true, false);
+		FreeShard* oldest = nullptr;
+		std::chrono::steady_clock::time_point oldestTime;
+		for (auto& shard : FreeShards)
+		{
+			std::unique_lock guard(shard.Mutex);
+			if (auto slot = FindOldestLocked(shard, sizeOf); slot && (!oldest || slot->second->second->Released < oldestTime))
+			{
+				oldest = &shard;
+				oldestTime = slot->second->second->Released;
+			}
+		}
+		if (!oldest)
+			return 0;
+		rc<ResourceT> evicted;
+		std::unique_lock guard(oldest->Mutex);
+		auto slot = FindOldestLocked(*oldest, sizeOf);
+		if (!slot)
+			return 0;
+		evicted = EvictSlot(*oldest, slot->first, slot->second);
+		guard.unlock();
+		return sizeOf(*evicted);
+	}
+
+	void StopEvictionThread()
+	{
+		std::thread thread;
+		{
+			std::unique_lock lock(EvictionMutex);
+			StopEviction = true;
+			thread = std::move(EvictionThread);
 		}
+		EvictionCondition.notify_all();
+		if (thread.joinable())
+			thread.join();
+		EvictionRunning = false;
 	}
 
 	void GarbageCollect()
 	{
-		std::unique_lock guard(Mutex);
-		Free.clear();
-		ReadyResourceMemoryUsage = 0;
+		for (auto& slot : CacheSlots)
+			SpillCache(slot, true, false);
+		for (auto& shard : FreeShards)
+		{
+			FreeSlotMap free;
+			{
+				std::unique_lock guard(shard.Mutex);
+				for (auto& [info, slots] : shard.Free)
+				{
+					OnFreeListRemoved(info);
+					AvailableCount -= slots.size();
+					Evictions += slots.size();
+					for (auto& [res, _] : slots)
+					{
+						ReadyResourceMemoryUsage -= TraitsT::GetSize(*res);
+						EvictedBytes += TraitsT::GetSize(*res);
+					}
+				}
+				free.swap(shard.Free);
+				shard.Lru.clear();
+			}
+		}
 	}
 
 	bool IsUsed(uint64_t handle)
 	{
-		std::shared_lock guard(Mutex);
-		return Used.contains(handle);
+		auto& shard = GetUsedShard(handle);
+		std::unique_lock guard(shard.Mutex);
+		return shard.Used.contains(handle);
 	}
 
 	ResourceT* FindUsed(uint64_t handle)
 	{
-		std::shared_lock guard(Mutex);
-		auto it = Used.find(handle);
-		if (it == Used.end())
+		auto& shard = GetUsedShard(handle);
+		std::unique_lock guard(shard.Mutex);
+		auto it = shard.Used.find(handle);
+		if (it == shard.Used.end())
 			return nullptr;
 		return it->second.Resource.get();
 	}
 
 	uint64_t GetAvailableResourceCount()
 	{
-		std::shared_lock guard(Mutex);
-		uint64_t ret = 0;
-		for (auto& [info, freeList] : Free)
-			ret += freeList.size();
-		return ret;
+		return AvailableCount;
 	}
 
 	uint64_t GetUsedResourceCount()
 	{
-		std::shared_lock guard(Mutex);
-		return Used.size();
+		return UsedCount;
 	}
 
 	uint64_t GetTotalMemoryUsage()
 	{
-		std::shared_lock guard(Mutex);
 		return GetReadyResourceMemoryUsage() + GetUsedResourceMemoryUsage();
 	}
 
-	/// Not thread safe.
 	uint64_t GetReadyResourceMemoryUsage()
 	{
 		return ReadyResourceMemoryUsage;
 	}
 
-	/// Not thread safe.
 	uint64_t GetUsedResourceMemoryUsage()
 	{
 		return UsedResourceMemoryUsage;
 	}
+
+	Stats GetStats()
+	{
+		return {
+			.Hits = Hits,
+			.Misses = Misses,
+			.Evictions = Evictions,
+			.EvictedBytes = EvictedBytes,
+			.TotalAllocationTime = std::chrono::nanoseconds(TotalAllocationTime),
+			.MaxAllocationTime = std::chrono::nanoseconds(MaxAllocationTime),
+			.AvailableCount = AvailableCount,
+			.UsedCount = UsedCount,
+			.ReadyBytes = ReadyResourceMemoryUsage,
+			.UsedBytes = UsedResourceMemoryUsage,
+		};
+	}
+
+	std::optional<TagStats> GetTagStats(std::string const& tag)
+	{
+		auto& shard = GetTagShard(tag);
+		std::unique_lock guard(shard.Mutex);
+		auto it = shard.Tags.find(tag);
+		if (it == shard.Tags.end())
+			return std::nullopt;
+		return it->second;
+	}
+
+	/// Tags with the most live bytes, at most count of them
+	std::vector<TagStats> GetLargestTags(size_t count)
+	{
+		std::vector<TagStats> largest;
+		auto isLarger = [](TagStats const& l, TagStats const& r) { return l.LiveBytes > r.LiveBytes; };
+		for (auto& shard : TagShards)
+		{
+			std::unique_lock guard(shard.Mutex);
+			for (auto& [tag, stats] : shard.Tags)
+			{
+				if (largest.size() == count && !isLarger(stats, largest.front()))
+					continue;
+				if (largest.size() == count)
+				{
+					std::pop_heap(largest.begin(), largest.end(), isLarger);
+					largest.pop_back();
+				}
+				largest.push_back(stats);
+				std::push_heap(largest.begin(), largest.end(), isLarger);
+			}
+		}
+		std::sort_heap(largest.begin(), largest.end(), isLarger);
+		return largest;
+	}
+
+	/// Forgets peak bytes and tags that have nothing in use
+	void ResetTagPeaks()
+	{
+		for (auto& shard : TagShards)
+		{
+			std::unique_lock guard(shard.Mutex);
+			std::erase_if(shard.Tags, [](auto& entry) { return !entry.second.Count; });
+			for (auto& [tag, stats] : shard.Tags)
+				stats.PeakBytes = stats.LiveBytes;
+		}
+	}
 	
 	void SetUsedResourceTag(uint64_t handle, std::string tag)
 	{ 
-		std::unique_lock guard(Mutex);
-		auto it = Used.find(handle);
-		if (it == Used.end())
+		auto& shard = GetUsedShard(handle);
+		std::unique_lock guard(shard.Mutex);
+		auto it = shard.Used.find(handle);
+		if (it == shard.Used.end())
 		{
 			GLog.W("Trying to change the tag of an invalid resource.");
 			return;
 		}
+		RemoveTagUsage(it->second.Tag, TraitsT::GetSize(*it->second.Resource));
+		AddTagUsage(tag, TraitsT::GetSize(*it->second.Resource));
 		it->second.Tag = std::move(tag);
 	}
 
-	UsedMap GetUsed() { std::shared_lock guard(Mutex); return Used; }
-	FreeMap GetFree() { std::shared_lock guard(Mutex); return Free; }
+	UsedMap GetUsed()
+	{
+		UsedMap used;
+		for (auto& shard : UsedShards)
+		{
+			std::unique_lock guard(shard.Mutex);
+			used.insert(shard.Used.begin(), shard.Used.end());
+		}
+		return used;
+	}
+
+	FreeMap GetFree()
+	{
+		for (auto& slot : CacheSlots)
+			SpillCache(slot, true, false);
+		FreeMap free;
+		for (auto& shard : FreeShards)
+		{
+			std::unique_lock guard(shard.Mutex);
+			for (auto& [info, slots] : shard.Free)
+				for (auto& [res, _] : slots)
+					free[info].push_back(res);
+		}
+		return free;
+	}
 
 	void SetMaxUnusedTime(std::chrono::milliseconds time)
 	{
-		std::unique_lock guard(Mutex); 
 		MaxUnusedTime = time;
 	}
+
+	/// Peak concurrent demand per creation info since creation or the last ResetPeakUsage
+	Manifest GetPeakUsage()
+	{
+		Manifest manifest;
+		for (auto& shard : FreeShards)
+		{
+			std::unique_lock guard(shard.Mutex);
+			for (auto& [info, demand] : shard.Demands)
+				if (demand.Peak)
+					manifest.emplace_back(info, demand.Peak);
+		}
+		return manifest;
+	}
+
+	void ResetPeakUsage()
+	{
+		for (auto& shard : FreeShards)
+		{
+			std::unique_lock guard(shard.Mutex);
+			std::erase_if(shard.Demands, [](auto& entry) { return !entry.second.Live; });
+			for (auto& [info, demand] : shard.Demands)
+				demand.Peak = demand.Live;
+		}
+	}
+
+	/// Writes the peak usage to a text manifest, one creation info per line. Imported resources are skipped.
+	bool SaveManifest(std::string const& path)
+	{
+		std::ofstream file(path);
+		if (!file.is_open())
+		{
+			GLog.W("Unable to write resource pool manifest to %s", path.c_str());
+			return false;
+		}
+		file << ManifestHeader << "\n";
+		for (auto& [info, peak] : GetPeakUsage())
+		{
+			if (!detail::CreationInfoSerializer<CreationInfoT>::IsSerializable(info))
+				continue;
+			file << peak << " ";
+			detail::CreationInfoSerializer<CreationInfoT>::Write(file, info);
+			file << "\n";
+		}
+		return file.good();
+	}
+
+	static std::optional<Manifest> LoadManifest(std::string const& path)
+	{
+		std::ifstream file(path);
+		if (!file.is_open())
+			return std::nullopt;
+		std::string header;
+		if (!std::getline(file, header) || header != ManifestHeader)
+		{
+			GLog.W("Ignoring resource pool manifest %s with an unknown format", path.c_str());
+			return std::nullopt;
+		}
+		Manifest manifest;
+		uint64_t peak;
+		CreationInfoT info{};
+		while (file >> peak && detail::CreationInfoSerializer<CreationInfoT>::Read(file, info))
+			manifest.emplace_back(info, peak);
+		return manifest;
+	}
+
+	/// Creates free resources until each creation info in the manifest has as many as its recorded peak,
+	/// counting the ones that already exist. Prewarmed resources still expire after MaxUnusedTime.
+	void Prewarm(Manifest const& manifest)
+	{
+		for (auto& [info, peak] : manifest)
+		{
+			auto adjusted = AdjustCreationInfo(info);
+			for (uint64_t count = GetResourceCount(adjusted); count < peak && !StopPrewarming; ++count)
+			{
+				CheckMemoryBudget();
+				auto res = TraitsT::Create(Device, adjusted);
+				if (!res)
+					return;
+				ReadyResourceMemoryUsage += TraitsT::GetSize(*res);
+				++AvailableCount;
+				PutFree(adjusted, std::move(res), std::chrono::steady_clock::now());
+			}
+		}
+	}
+
+	/// Prewarms on a background thread, a previous prewarm still running is stopped first.
+	/// Derived pools call StopPrewarm in their destructor, the thread uses their overrides.
+	void PrewarmAsync(Manifest manifest)
+	{
+		StopPrewarm();
+		StopPrewarming = false;
+		PrewarmThread = std::thread([this, manifest = std::move(manifest)] { Prewarm(manifest); });
+	}
+
+	void StopPrewarm()
+	{
+		StopPrewarming = true;
+		if (PrewarmThread.joinable())
+			PrewarmThread.join();
+	}
 protected:
+	static constexpr const char* ManifestHeader = "nosVulkan resource pool manifest 1";
+
+	// Free, cached and live resources of a creation info, deferred ones are still live
+	uint64_t GetResourceCount(CreationInfoT const& info)
+	{
+		CreationInfoEqualsT equals;
+		uint64_t count = 0;
+		// Slots are locked before shards elsewhere, so they are counted first
+		for (auto& slot : CacheSlots)
+		{
+			LockSlot(slot, true);
+			for (uint32_t i = 0; i < slot.Count; ++i)
+				count += equals(slot.Entries[i].CreationInfo, info);
+			UnlockSlot(slot);
+		}
+		auto& shard = GetFreeShard(info);
+		std::unique_lock guard(shard.Mutex);
+		if (auto it = shard.Free.find(info); it != shard.Free.end())
+			count += it->second.size();
+		if (auto it = shard.Demands.find(info); it != shard.Demands.end())
+			count += it->second.Live;
+		return count;
+	}
+
+	struct Demand
+	{
+		uint64_t Live = 0;
+		uint64_t Peak = 0;
+	};
+
+	struct FreeShard
+	{
+		std::mutex Mutex;
+		FreeSlotMap Free;
+		LruList Lru;
+		MapWithCreationInfoAsKey<Demand> Demands;
+	};
+
+	struct UsedShard
+	{
+		std::mutex Mutex;
+		UsedMap Used;
+	};
+
+	struct TagShard
+	{
+		std::mutex Mutex;
+		std::unordered_map<std::string, TagStats> Tags;
+	};
+
+	struct CachedResource
+	{
+		CreationInfoT CreationInfo{};
+		rc<ResourceT> Resource;
+		std::chrono::steady_clock::time_point Released;
+	};
+
+	// Only used when it can be taken without waiting, except when flushing it back to the shards
+	struct CacheSlot
+	{
+		std::atomic_flag Busy;
+		uint32_t Count = 0;
+		std::array<CachedResource, CacheSlotSize> Entries; // Oldest first
+	};
+
+	// Lets derived pools map a request onto a creation info that is shared by more requests
+	virtual CreationInfoT AdjustCreationInfo(CreationInfoT const& info) { return info; }
+	// Called when there is no free resource with the exact creation info, sets actualInfo to the info of the one it returns
+	virtual rc<ResourceT> TakeCompatibleFree(CreationInfoT const& info, CreationInfoT& actualInfo) { return nullptr; }
+	// Let derived pools index the creation infos that have free resources, called with the shard locked
+	virtual void OnFreeListAdded(CreationInfoT const& info) {}
+	virtual void OnFreeListRemoved(CreationInfoT const& info) {}
+
+	FreeShard& GetFreeShard(CreationInfoT const& info)
+	{
+		return FreeShards[CreationInfoHasherT{}(info) % ShardCount];
+	}
+
+	UsedShard& GetUsedShard(uint64_t handle)
+	{
+		return UsedShards[((handle * 0x9E3779B97F4A7C15ull) >> 32) % ShardCount];
+	}
+
+	TagShard& GetTagShard(std::string const& tag)
+	{
+		return TagShards[std::hash<std::string>{}(tag) % ShardCount];
+	}
+
+	void AddTagUsage(std::string const& tag, uint64_t size)
+	{
+		auto& shard = GetTagShard(tag);
+		std::unique_lock guard(shard.Mutex);
+		auto [it, inserted] = shard.Tags.try_emplace(tag);
+		auto& stats = it->second;
+		if (inserted)
+			stats.Tag = tag;
+		++stats.Count;
+		stats.LiveBytes += size;
+		stats.PeakBytes = std::max(stats.PeakBytes, stats.LiveBytes);
+	}
+
+	void RemoveTagUsage(std::string const& tag, uint64_t size)
+	{
+		auto& shard = GetTagShard(tag);
+		std::unique_lock guard(shard.Mutex);
+		auto it = shard.Tags.find(tag);
+		if (it == shard.Tags.end())
+			return;
+		--it->second.Count;
+		it->second.LiveBytes -= size;
+	}
+
+	void RecordAllocation(std::chrono::nanoseconds duration)
+	{
+		++Misses;
+		TotalAllocationTime += duration.count();
+		auto max = MaxAllocationTime.load();
+		while (duration.count() > max && !MaxAllocationTime.compare_exchange_weak(max, duration.count()))
+			;
+	}
+
+	// Fences, semaphores and descriptor sets hold no device memory, their pools neither add to nor relieve the budget
+	void CheckMemoryBudget()
+	{
+		if constexpr (requires(ResourceT const& res) { res.AllocationInfo; })
+			detail::CheckMemoryBudget(Device);
+	}
+
+	CacheSlot& GetCacheSlot()
+	{
+		return CacheSlots[std::hash<std::thread::id>{}(std::this_thread::get_id()) % CacheSlotCount];
+	}
+
+	rc<ResourceT> GetAvailable(CreationInfoT const& info, std::string tag)
+	{
+		// The resource goes back under its own creation info, which can differ from the request
+		CreationInfoT actualInfo = info;
+		auto& ownSlot = GetCacheSlot();
+		rc<ResourceT> res = TakeCached(ownSlot, info);
+		if (!res)
+			res = TakeFree(info);
+		// Released synchronously on another thread, the resource only reaches a shard once it expires
+		for (auto& slot : CacheSlots)
+			if (!res && &slot != &ownSlot)
+				res = TakeCached(slot, info);
+		if (!res)
+			res = TakeCompatibleFree(info, actualInfo);
+		if (res)
+			++Hits;
+		else
+		{
+			// Created outside of any lock
+			auto start = std::chrono::steady_clock::now();
+			res = TraitsT::Create(Device, info);
+			if (!res)
+				return nullptr;
+			RecordAllocation(std::chrono::steady_clock::now() - start);
+		}
+		AddDemand(actualInfo);
+		AddUsed(res, actualInfo, std::move(tag));
+		CheckAndClean();
+		return res;
+	}
+
+	void AddUsed(rc<ResourceT> const& res, CreationInfoT const& info, std::string tag)
+	{
+		auto handle = TraitsT::GetKey(*res);
+		auto& shard = GetUsedShard(handle);
+		{
+			std::unique_lock guard(shard.Mutex);
+			AddTagUsage(tag, TraitsT::GetSize(*res));
+			shard.Used[handle] = { std::move(tag), info, res };
+		}
+		++UsedCount;
+		UsedResourceMemoryUsage += TraitsT::GetSize(*res);
+	}
+
+	std::optional<UsedResourceInfo> TakeUsed(uint64_t handle)
+	{
+		auto& shard = GetUsedShard(handle);
+		std::unique_lock guard(shard.Mutex);
+		auto it = shard.Used.find(handle);
+		if (it == shard.Used.end())
+			return std::nullopt;
+		std::optional<UsedResourceInfo> used = std::move(it->second);
+		shard.Used.erase(it);
+		RemoveTagUsage(used->Tag, TraitsT::GetSize(*used->Resource));
+		--UsedCount;
+		return used;
+	}
+
+	// Moves a resource from used to available accounting, false if it cannot be reused and should be destroyed
+	bool MarkAvailable(CreationInfoT const& info, rc<ResourceT> const& res)
+	{
+		RemoveDemand(info);
+		UsedResourceMemoryUsage -= TraitsT::GetSize(*res);
+		if (!TraitsT::Recycle(*res, info))
+			return false;
+		ReadyResourceMemoryUsage += TraitsT::GetSize(*res);
+		++AvailableCount;
+		return true;
+	}
+
+	void MarkTaken(rc<ResourceT> const& res)
+	{
+		ReadyResourceMemoryUsage -= TraitsT::GetSize(*res);
+		--AvailableCount;
+	}
+
+	void MakeFree(CreationInfoT const& info, rc<ResourceT> res)
+	{
+		if (MarkAvailable(info, res))
+			PutFree(info, std::move(res), std::chrono::steady_clock::now());
+	}
+
+	void PutFree(CreationInfoT const& info, rc<ResourceT> res, std::chrono::steady_clock::time_point released)
+	{
+		auto& shard = GetFreeShard(info);
+		std::unique_lock guard(shard.Mutex);
+		auto lru = shard.Lru.insert(shard.Lru.end(), LruEntry{released, info});
+		auto& freeList = shard.Free[info];
+		if (freeList.empty())
+			OnFreeListAdded(info);
+		freeList.emplace_back(std::move(res), lru);
+	}
+
+	rc<ResourceT> TakeFree(CreationInfoT const& info)
+	{
+		auto& shard = GetFreeShard(info);
+		std::unique_lock guard(shard.Mutex);
+		auto it = shard.Free.find(info);
+		if (it == shard.Free.end())
+			return nullptr;
+		return TakeFreeLocked(shard, it);
+	}
+
+	// Takes the newest resource of the creation info, the shard must be locked
+	rc<ResourceT> TakeFreeLocked(FreeShard& shard, typename FreeSlotMap::iterator it)
+	{
+		auto& freeList = it->second;
+		auto [res, lru] = std::move(freeList.back());
+		freeList.pop_back();
+		shard.Lru.erase(lru);
+		if (freeList.empty())
+		{
+			OnFreeListRemoved(it->first);
+			shard.Free.erase(it);
+		}
+		MarkTaken(res);
+		return res;
+	}
+
+	bool LockSlot(CacheSlot& slot, bool wait)
+	{
+		while (slot.Busy.test_and_set(std::memory_order_acquire))
+		{
+			if (!wait)
+				return false;
+			slot.Busy.wait(true, std::memory_order_relaxed);
+		}
+		return true;
+	}
+
+	void UnlockSlot(CacheSlot& slot)
+	{
+		slot.Busy.clear(std::memory_order_release);
+		slot.Busy.notify_one();
+	}
+
+	// Slots that are busy are skipped rather than waited on
+	rc<ResourceT> TakeCached(CacheSlot& slot, CreationInfoT const& info)
+	{
+		if (!LockSlot(slot, false))
+			return nullptr;
+		CreationInfoEqualsT equals;
+		rc<ResourceT> res;
+		for (uint32_t i = slot.Count; i-- > 0;)
+		{
+			if (!equals(slot.Entries[i].CreationInfo, info))
+				continue;
+			res = std::move(slot.Entries[i].Resource);
+			std::move(slot.Entries.begin() + i + 1, slot.Entries.begin() + slot.Count, slot.Entries.begin() + i);
+			--slot.Count;
+			break;
+		}
+		UnlockSlot(slot);
+		if (res)
+			MarkTaken(res);
+		return res;
+	}
+
+	bool PutCached(CreationInfoT const& info, rc<ResourceT>& res)
+	{
+		auto& slot = GetCacheSlot();
+		if (!LockSlot(slot, false))
+			return false;
+		if (!MarkAvailable(info, res))
+		{
+			// Left to the caller to destroy
+			UnlockSlot(slot);
+			return true;
+		}
+		if (slot.Count == CacheSlotSize)
+		{
+			auto& oldest = slot.Entries[0];
+			PutFree(oldest.CreationInfo, std::move(oldest.Resource), oldest.Released);
+			std::move(slot.Entries.begin() + 1, slot.Entries.end(), slot.Entries.begin());
+			--slot.Count;
+		}
+		slot.Entries[slot.Count++] = CachedResource{info, std::move(res), std::chrono::steady_clock::now()};
+		UnlockSlot(slot);
+		return true;
+	}
+
+	// Moves cached resources to the shards, all of them or only the expired ones
+	void SpillCache(CacheSlot& slot, bool wait, bool expiredOnly)
+	{
+		if (!LockSlot(slot, wait))
+			return;
+		auto now = std::chrono::steady_clock::now();
+		std::chrono::milliseconds maxUnusedTime = MaxUnusedTime;
+		uint32_t kept = 0;
+		for (uint32_t i = 0; i < slot.Count; ++i)
+		{
+			auto& entry = slot.Entries[i];
+			if (expiredOnly && now - entry.Released <= maxUnusedTime)
+				slot.Entries[kept++] = std::move(entry);
+			else
+				PutFree(entry.CreationInfo, std::move(entry.Resource), entry.Released);
+		}
+		slot.Count = kept;
+		UnlockSlot(slot);
+	}
+
+	// The shard must be locked, evicted resources are destroyed by the caller once it is unlocked
+	void EvictExpired(FreeShard& shard, uint32_t maxCount, std::vector<rc<ResourceT>>& evicted)
+	{
+		auto now = std::chrono::steady_clock::now();
+		std::chrono::milliseconds maxUnusedTime = MaxUnusedTime;
+		for (uint32_t i = 0; i < maxCount && !shard.Lru.empty() && now - shard.Lru.front().Released > maxUnusedTime; ++i)
+			evicted.push_back(EvictFront(shard));
+	}
+
+	rc<ResourceT> EvictFront(FreeShard& shard)
+	{
+		auto freeIt = shard.Free.find(shard.Lru.front().CreationInfo);
+		assert(freeIt != shard.Free.end() && freeIt->second.front().second == shard.Lru.begin());
+		return EvictSlot(shard, freeIt, freeIt->second.begin());
+	}
+
+	// Oldest free slot of the shard that sizeOf measures as non-zero, the shard must be locked
+	std::optional<std::pair<typename FreeSlotMap::iterator, typename FreeSlots::iterator>> FindOldestLocked(FreeShard& shard,
+																											uint64_t (*sizeOf)(ResourceT const&))
+	{
+		std::optional<std::pair<typename FreeSlotMap::iterator, typename FreeSlots::iterator>> oldest;
+		for (auto freeIt = shard.Free.begin(); freeIt != shard.Free.end(); ++freeIt)
+			for (auto slot = freeIt->second.begin(); slot != freeIt->second.end(); ++slot)
+			{
+				// Slots of a creation info are in release order, the first measured one is its oldest
+				if (!sizeOf(*slot->first))
+					continue;
+				if (!oldest || slot->second->Released < oldest->second->second->Released)
+					oldest.emplace(freeIt, slot);
+				break;
+			}
+		return oldest;
+	}
+
+	rc<ResourceT> EvictSlot(FreeShard& shard, typename FreeSlotMap::iterator freeIt, typename FreeSlots::iterator slot)
+	{
+		auto res = std::move(slot->first);
+		shard.Lru.erase(slot->second);
+		freeIt->second.erase(slot);
+		if (freeIt->second.empty())
+		{
+			OnFreeListRemoved(freeIt->first);
+			shard.Free.erase(freeIt);
+		}
+		MarkTaken(res);
+		++Evictions;
+		EvictedBytes += TraitsT::GetSize(*res);
+		return res;
+	}
+
+	void AddDemand(CreationInfoT const& info)
+	{
+		auto& shard = GetFreeShard(info);
+		std::unique_lock guard(shard.Mutex);
+		auto& demand = shard.Demands[info];
+		demand.Peak = std::max(demand.Peak, ++demand.Live);
+	}
+
+	void RemoveDemand(CreationInfoT const& info)
+	{
+		auto& shard = GetFreeShard(info);
+		std::unique_lock guard(shard.Mutex);
+		auto it = shard.Demands.find(info);
+		if (it != shard.Demands.end() && it->second.Live)
+			--it->second.Live;
+	}
+
+	void CompleteDeferred(uint64_t handle, uint64_t token)
+	{
+		DeferredResourceInfo deferred;
+		{
+			std::unique_lock guard(DeferredMutex);
+			auto it = Deferred.find(handle);
+			// Taken back by Get or released again since
+			if (it == Deferred.end() || it->second.Token != token)
+				return;
+			deferred = std::move(it->second);
+			Deferred.erase(it);
+		}
+		MakeFree(deferred.CreationInfo, std::move(deferred.Resource));
+		CheckAndClean();
+	}
+
+	void CollectDeferred()
+	{
+		if (!TimelineDeferredCount)
+			return;
+		std::vector<DeferredResourceInfo> completed;
+		{
+			std::unique_lock guard(DeferredMutex);
+			std::unordered_map<VkSemaphore, uint64_t> values;
+			for (auto it = Deferred.begin(); it != Deferred.end();)
+			{
+				auto& deferred = it->second;
+				if (!deferred.Timeline)
+				{
+					++it;
+					continue;
+				}
+				auto [value, inserted] = values.try_emplace(deferred.Timeline, 0);
+				if (inserted)
+					value->second = detail::GetTimelineValue(Device, deferred.Timeline);
+				if (value->second < deferred.Value)
+				{
+					++it;
+					continue;
+				}
+				completed.push_back(std::move(deferred));
+				it = Deferred.erase(it);
+				--TimelineDeferredCount;
+			}
+		}
+		for (auto& deferred : completed)
+			MakeFree(deferred.CreationInfo, std::move(deferred.Resource));
+	}
+
 	vk::Device* Device;
-	UsedMap Used;
-	FreeMap Free;
+	std::array<FreeShard, ShardCount> FreeShards;
+	std::array<UsedShard, ShardCount> UsedShards;
+	std::array<CacheSlot, CacheSlotCount> CacheSlots;
+	std::array<TagShard, ShardCount> TagShards;
+	std::atomic_uint32_t NextCleanShard = 0;
+
+	std::mutex DeferredMutex;
+	DeferredMap Deferred;
+	uint64_t DeferredToken = 0;
+	std::atomic_uint64_t TimelineDeferredCount = 0;
+
 	CountsPerType AllocatedCounts;
-	std::shared_mutex Mutex{};
-	std::unordered_map<CreationInfoT, std::chrono::steady_clock::time_point, CreationInfoHasherT, CreationInfoEqualsT> ReleaseTime;
+
+	std::thread EvictionThread;
+	std::mutex EvictionMutex;
+	std::condition_variable EvictionCondition;
+	bool StopEviction = false;
+	std::atomic_bool EvictionRunning = false;
+
+	std::thread PrewarmThread;
+	std::atomic_bool StopPrewarming = false;
 
 	// Options
-	std::chrono::milliseconds MaxUnusedTime;
+	std::atomic<std::chrono::milliseconds> MaxUnusedTime;
 
 	// Runtime memory usage info
-	uint64_t UsedResourceMemoryUsage = 0;
-	uint64_t ReadyResourceMemoryUsage = 0;
+	std::atomic_uint64_t UsedResourceMemoryUsage = 0;
+	std::atomic_uint64_t ReadyResourceMemoryUsage = 0;
+	std::atomic_uint64_t AvailableCount = 0;
+	std::atomic_uint64_t UsedCount = 0;
 
+	// Telemetry
+	std::atomic_uint64_t Hits = 0;
+	std::atomic_uint64_t Misses = 0;
+	std::atomic_uint64_t Evictions = 0;
+	std::atomic_uint64_t EvictedBytes = 0;
+	std::atomic_int64_t TotalAllocationTime = 0; // ns
+	std::atomic_int64_t MaxAllocationTime = 0; // ns
 };
 
 // TODO: Move below to ResourceManager.cpp after if/when ResourcePool is fully generic
@@ -235,9 +1168,220 @@ struct BufferCreateInfoEquals
 		return l.Size == r.Size && l.MemProps == r.MemProps && l.Usage == r.Usage && l.ExternalMemoryHandleType == r.ExternalMemoryHandleType;
 	}
 };
+
+template <>
+struct CreationInfoSerializer<vk::ImageCreateInfo>
+{
+	static bool IsSerializable(vk::ImageCreateInfo const& info) { return !info.Imported; }
+	static void Write(std::ostream& out, vk::ImageCreateInfo const& info)
+	{
+		out << info.Extent.width << " " << info.Extent.height << " " << info.Format << " " << info.Usage << " " << info.Samples << " "
+			<< info.Tiling << " " << info.Flags << " " << info.ExternalMemoryHandleType;
+	}
+	static bool Read(std::istream& in, vk::ImageCreateInfo& info)
+	{
+		uint32_t format, samples, tiling;
+		in >> info.Extent.width >> info.Extent.height >> format >> info.Usage >> samples >> tiling >> info.Flags >> info.ExternalMemoryHandleType;
+		info.Format = VkFormat(format);
+		info.Samples = VkSampleCountFlagBits(samples);
+		info.Tiling = VkImageTiling(tiling);
+		info.Imported = nullptr;
+		return bool(in);
+	}
+};
+
+template <>
+struct CreationInfoSerializer<vk::BufferCreateInfo>
+{
+	static bool IsSerializable(vk::BufferCreateInfo const& info) { return !info.Imported; }
+	static void Write(std::ostream& out, vk::BufferCreateInfo const& info)
+	{
+		out << info.Size << " " << info.Usage << " " << info.MemProps.Mapped << " " << info.MemProps.VRAM << " " << info.MemProps.Download << " "
+			<< info.MemProps.Alignment << " " << info.ExternalMemoryHandleType << " " << info.ElementType;
+	}
+	static bool Read(std::istream& in, vk::BufferCreateInfo& info)
+	{
+		in >> info.Size >> info.Usage >> info.MemProps.Mapped >> info.MemProps.VRAM >> info.MemProps.Download >> info.MemProps.Alignment >>
+			info.ExternalMemoryHandleType >> info.ElementType;
+		info.Imported = nullptr;
+		return bool(in);
+	}
+};
 } // namespace detail
 
 using ImagePool = ResourcePool<vk::Image, vk::ImageCreateInfo, detail::ImageCreateInfoHasher, detail::ImageCreateInfoEquals>;
-using BufferPool = ResourcePool<vk::Buffer, vk::BufferCreateInfo, detail::BufferCreateInfoHasher, detail::BufferCreateInfoEquals>;
+
+class BufferPool : public ResourcePool<vk::Buffer, vk::BufferCreateInfo, detail::BufferCreateInfoHasher, detail::BufferCreateInfoEquals>
+{
+public:
+	using ResourcePool::ResourcePool;
+
+	~BufferPool() override
+	{
+		StopPrewarm();
+		StopEvictionThread();
+	}
+
+	/// Off by default. When enabled, requested sizes are rounded up to geometric size classes that grow by slackRatio,
+	/// and a request with no free buffer in its class can take a free one that is at most slackRatio larger and
+	/// whose usage and memory properties cover it. Buffers can then be larger than requested, so code that
+	/// depends on Buffer::Size (e.g. runtime array lengths in whole-size bindings) should keep this off.
+	void SetCompatibilityMode(bool enabled, float slackRatio = .25f)
+	{
+		SlackRatio = std::max(slackRatio, 0.f);
+		Compatible = enabled;
+	}
+
+	static u64 GetSizeClass(u64 size, float slackRatio)
+	{
+		u64 sizeClass = 256;
+		while (sizeClass < size)
+			sizeClass = std::max(sizeClass + 256, u64(sizeClass * (1.0 + slackRatio)) & ~u64(255));
+		return sizeClass;
+	}
+
+protected:
+	std::atomic_bool Compatible = false;
+	std::atomic<float> SlackRatio = .25f;
+
+	static bool IsPoolable(vk::BufferCreateInfo const& info)
+	{
+		return !info.Imported;
+	}
+
+	vk::BufferCreateInfo AdjustCreationInfo(vk::BufferCreateInfo const& info) override
+	{
+		if (!Compatible || !IsPoolable(info))
+			return info;
+		auto adjusted = info;
+		adjusted.Size = GetSizeClass(info.Size, SlackRatio);
+		return adjusted;
+	}
+
+	// Creation infos with free buffers by size, kept for every poolable info so the mode can be switched at any time
+	std::mutex FreeBySizeMutex;
+	std::multimap<u64, vk::BufferCreateInfo> FreeBySize;
+
+	void OnFreeListAdded(vk::BufferCreateInfo const& info) override
+	{
+		if (!IsPoolable(info))
+			return;
+		std::unique_lock guard(FreeBySizeMutex);
+		FreeBySize.emplace(info.Size, info);
+	}
+
+	void OnFreeListRemoved(vk::BufferCreateInfo const& info) override
+	{
+		if (!IsPoolable(info))
+			return;
+		detail::BufferCreateInfoEquals equals;
+		std::unique_lock guard(FreeBySizeMutex);
+		auto [first, last] = FreeBySize.equal_range(info.Size);
+		for (auto it = first; it != last; ++it)
+			if (equals(it->second, info))
+			{
+				FreeBySize.erase(it);
+				return;
+			}
+	}
+
+	rc<vk::Buffer> TakeCompatibleFree(vk::BufferCreateInfo const& info, vk::BufferCreateInfo& actualInfo) override
+	{
+		if (!Compatible || !IsPoolable(info))
+			return nullptr;
+		u64 maxSize = u64(info.Size * (1.0 + SlackRatio));
+		// Only the size classes in range are visited, smallest first
+		std::optional<vk::BufferCreateInfo> best;
+		{
+			std::unique_lock guard(FreeBySizeMutex);
+			for (auto it = FreeBySize.lower_bound(info.Size); it != FreeBySize.end() && it->first <= maxSize && !best; ++it)
+			{
+				auto& freeInfo = it->second;
+				// VRAM and Download pick the memory type, so only mapping and alignment may be stronger
+				if ((freeInfo.Usage & info.Usage) != info.Usage || freeInfo.MemProps.VRAM != info.MemProps.VRAM ||
+					freeInfo.MemProps.Download != info.MemProps.Download || freeInfo.MemProps.Mapped < info.MemProps.Mapped ||
+					freeInfo.MemProps.Alignment < info.MemProps.Alignment ||
+					freeInfo.ExternalMemoryHandleType != info.ExternalMemoryHandleType || freeInfo.ElementType != info.ElementType)
+					continue;
+				best = freeInfo;
+			}
+		}
+		if (!best)
+			return nullptr;
+		// Another thread can take the candidate in between, then the request creates a new buffer
+		auto& shard = GetFreeShard(*best);
+		std::unique_lock guard(shard.Mutex);
+		auto it = shard.Free.find(*best);
+		if (it == shard.Free.end())
+			return nullptr;
+		actualInfo = *best;
+		return TakeFreeLocked(shard, it);
+	}
+};
+
+// Semaphores are keyed by type. Binary semaphores must be unsignaled with no pending wait when released,
+// timeline semaphores keep their counter value so users should continue from GetValue.
+using SemaphorePool = ResourcePool<vk::Semaphore, VkSemaphoreType>;
+
+// Fences are reset when released, so release them only after their work is waited on.
+// Fences created signaled cannot be handed out signaled again and are destroyed instead.
+template <>
+struct ResourcePoolTraits<vk::Fence, VkFenceCreateFlags>
+{
+	static rc<vk::Fence> Create(vk::Device* device, VkFenceCreateFlags flags) { return vk::Fence::New(device, flags); }
+	static uint64_t GetKey(vk::Fence const& fence) { return uint64_t(fence.Handle); }
+	static uint64_t GetSize(vk::Fence const&) { return 0; }
+	static bool Recycle(vk::Fence& fence, VkFenceCreateFlags flags)
+	{
+		if (flags & VK_FENCE_CREATE_SIGNALED_BIT)
+			return false;
+		fence.Reset();
+		return true;
+	}
+};
+
+using FencePool = ResourcePool<vk::Fence, VkFenceCreateFlags>;
+
+// Descriptor sets of one set index and layout allocated from a descriptor pool. Released sets are rewritten by
+// their next user, so release them to the command buffer that binds them rather than to nothing.
+struct DescriptorSetCreateInfo
+{
+	rc<DescriptorPool> Pool;
+	u32 Set = 0;
+	rc<struct PipelineLayout> Layout; // Layout the set is allocated for, the pool's own when null
+};
+
+namespace detail
+{
+struct DescriptorSetCreateInfoHasher
+{
+	size_t operator()(DescriptorSetCreateInfo const& info) const
+	{
+		size_t result = 0;
+		vk::hash_combine(result, info.Pool.get(), info.Set, info.Layout.get());
+		return result;
+	}
+};
+
+struct DescriptorSetCreateInfoEquals
+{
+	bool operator()(DescriptorSetCreateInfo const& l, DescriptorSetCreateInfo const& r) const
+	{
+		return l.Pool == r.Pool && l.Set == r.Set && l.Layout == r.Layout;
+	}
+};
+} // namespace detail
+
+// Defined in Layout.cpp, DescriptorSet is incomplete here
+template <>
+struct nosVulkan_API ResourcePoolTraits<vk::DescriptorSet, DescriptorSetCreateInfo>
+{
+	static rc<vk::DescriptorSet> Create(vk::Device* device, DescriptorSetCreateInfo const& info);
+	static uint64_t GetKey(vk::DescriptorSet const& set);
+	static uint64_t GetSize(vk::DescriptorSet const&) { return 0; }
+	static bool Recycle(vk::DescriptorSet&, DescriptorSetCreateInfo const&) { return true; }
+};
+
+using DescriptorSetPool = ResourcePool<vk::DescriptorSet, DescriptorSetCreateInfo, detail::DescriptorSetCreateInfoHasher, detail::DescriptorSetCreateInfoEquals>;
 
 }
@@ -0,0 +1,86 @@
+/*
+ * Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+ */
+
+#pragma once
+
+#include "Buffer.h"
+
+// std
+#include <deque>
+
+namespace nos::vk
+{
+
+struct nosVulkan_API StagingAllocation
+{
+    rc<vk::Buffer> Buffer;
+    VkDeviceSize Offset = 0;
+    VkDeviceSize Size = 0;
+    u64 Region = 0; // 0 if the ring was full and a standalone buffer is used instead
+
+    u8* Data() const { return Buffer->Map() + Offset; }
+    explicit operator bool() const { return Buffer != nullptr; }
+};
+
+// One large persistently mapped host-visible buffer that hands out sub-ranges in FIFO order.
+// A range is retired once the command buffer it was released to completes.
+struct nosVulkan_API StagingRing : SharedFactory<StagingRing>, DeviceChild
+{
+    static constexpr VkDeviceSize DefaultCapacity = 128ull << 20;
+
+    rc<vk::Buffer> Buffer;
+    VkDeviceSize Capacity;
+    VkDeviceSize Alignment;
+    VkBufferUsageFlags Usage;
+    MemoryProperties MemProps;
+    // When set, a full ring never hands out standalone buffers: it grows up to MaxCapacity,
+    // then waits for the oldest submitted range. Ranges from the old buffer stay valid until they retire.
+    VkDeviceSize MaxCapacity = 0;
+
+    StagingRing(Device* Vk, VkDeviceSize capacity = DefaultCapacity,
+                VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                MemoryProperties memProps = {.Mapped = true, .Download = true});
+
+    StagingAllocation Allocate(VkDeviceSize size, VkDeviceSize alignment = 0);
+    // Ties the allocation to Cmd: the range becomes reusable after Cmd completes. Allocate checks the pool timeline
+    // of submitted command buffers, so ranges do not wait for the command buffer to be cleared and reused.
+    // Ranges the host reads back in a Cmd callback pass hostRead, they are only retired once the callbacks ran.
+    void Release(rc<CommandBuffer> Cmd, StagingAllocation const& alloc, bool hostRead = false);
+    StagingAllocation Allocate(rc<CommandBuffer> Cmd, VkDeviceSize size, VkDeviceSize alignment = 0);
+
+    VkDeviceSize GetUsedSize();
+
+protected:
+    struct Region
+    {
+        VkDeviceSize Begin;
+        VkDeviceSize End;
+        bool Retired = false;
+        bool HostRead = false; // Skipped by RetireSubmitted, the Retire callback frees it
+        std::weak_ptr<CommandBuffer> Cmd; // Set by Release
+        rc<vk::Buffer> OldBuffer; // Last range of a buffer the ring grew out of keeps it alive
+    };
+
+    std::mutex Mutex;
+    std::deque<Region> Regions; // Region ids are contiguous, the front one is FrontRegion
+    u64 FrontRegion = 1;
+    u64 FirstLiveRegion = 1; // Regions before this one are in an old buffer
+    VkDeviceSize Head = 0;
+
+    // Offset of a free range in the current buffer
+    std::optional<VkDeviceSize> FindSpace(VkDeviceSize size, VkDeviceSize alignment);
+    // Start of the oldest range in use in the current buffer
+    std::optional<VkDeviceSize> GetTail();
+    void Grow(VkDeviceSize size);
+    // Blocks until the front range's command buffer completes, false if it is not submitted
+    bool WaitFront(std::unique_lock<std::mutex>& lock);
+
+    void Retire(u64 region);
+    void PopRetired();
+    // Retires front regions whose command buffer's submission has completed
+    void RetireSubmitted();
+    rc<vk::Buffer> CreateBuffer(VkDeviceSize size);
+};
+
+} // namespace nos::vk
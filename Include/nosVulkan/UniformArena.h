@@ -0,0 +1,55 @@
+/*
+ * Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+ */
+
+#pragma once
+
+#include "Buffer.h"
+
+namespace nos::vk
+{
+
+struct nosVulkan_API UniformAllocation
+{
+    rc<vk::Buffer> Buffer;
+    VkDeviceSize Offset = 0;
+    VkDeviceSize Size = 0;
+
+    u8* Data() const { return Buffer->Map() + Offset; }
+};
+
+// Linear sub-allocator for uniform data written on every bind.
+// Allocations are bumped out of fixed size mapped chunks, a chunk is recycled
+// after it has been filled and every command buffer that allocated from it has completed.
+struct nosVulkan_API UniformArena : SharedFactory<UniformArena>, DeviceChild
+{
+    static constexpr VkDeviceSize DefaultChunkSize = 4ull << 20;
+
+    VkDeviceSize ChunkSize;
+    VkDeviceSize Alignment; // minUniformBufferOffsetAlignment
+
+    UniformArena(Device* Vk, VkDeviceSize chunkSize = DefaultChunkSize);
+
+    // The returned range stays valid until Cmd completes
+    UniformAllocation Allocate(rc<CommandBuffer> Cmd, VkDeviceSize size);
+
+protected:
+    struct Chunk
+    {
+        rc<vk::Buffer> Buffer;
+        VkDeviceSize Head = 0;
+        u32 Users = 0;
+        CommandBuffer* LastUser = nullptr;
+        bool Full = false;
+        bool Dedicated = false;
+    };
+
+    std::mutex Mutex;
+    rc<Chunk> Current;
+    std::vector<rc<Chunk>> FreeChunks;
+
+    rc<Chunk> CreateChunk(VkDeviceSize size);
+    void Release(rc<Chunk> chunk, CommandBuffer* Cmd);
+};
+
+} // namespace nos::vk
@@ -10,8 +10,8 @@
 namespace nos::vk
 {
 
-Binding::Binding(rc<Buffer> res, u32 binding, u32 bufferOffset, u32 arrayIdx)
-    : Resource(res), Idx(binding), AccessFlags(0), BufferOffset(bufferOffset), ArrayIdx(arrayIdx)
+Binding::Binding(rc<Buffer> res, u32 binding, u32 bufferOffset, u32 arrayIdx, u32 bufferRange)
+    : Resource(res), Idx(binding), AccessFlags(0), BufferOffset(bufferOffset), ArrayIdx(arrayIdx), BufferRange(bufferRange)
 {
 }
 
@@ -93,6 +93,8 @@ DescriptorResourceInfo Binding::GetDescriptorInfo(VkDescriptorType type) const
     {
         Info = (*buf)->GetDescriptorInfo();
         Info.Buffer.offset = BufferOffset;
+        if (BufferRange)
+            Info.Buffer.range = BufferRange;
         assert(!usage || ((*buf)->Usage & usage));
     }
 
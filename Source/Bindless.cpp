@@ -0,0 +1,176 @@
+// Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+
+#include "nosVulkan/Bindless.h"
+#include "nosVulkan/Device.h"
+#include "nosVulkan/Command.h"
+#include "nosVulkan/Image.h"
+#include "nosVulkan/Buffer.h"
+#include "nosVulkan/Binding.h"
+
+namespace nos::vk
+{
+
+BindlessHeap::BindlessHeap(Device* Vk) : DeviceChild(Vk)
+{
+    VkPhysicalDeviceVulkan12Properties props12 = {.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES};
+    VkPhysicalDeviceProperties2 props2 = {.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, .pNext = &props12};
+    vkGetPhysicalDeviceProperties2(Vk->PhysicalDevice, &props2);
+
+    // Every binding is visible to all stages, so the per stage limits apply to the whole set
+    Capacity[SampledImageBinding] = std::min({DefaultSampledImages, props12.maxPerStageDescriptorUpdateAfterBindSampledImages, props12.maxDescriptorSetUpdateAfterBindSampledImages});
+    Capacity[StorageImageBinding] = std::min({DefaultStorageImages, props12.maxPerStageDescriptorUpdateAfterBindStorageImages, props12.maxDescriptorSetUpdateAfterBindStorageImages});
+    Capacity[StorageBufferBinding] = std::min({DefaultStorageBuffers, props12.maxPerStageDescriptorUpdateAfterBindStorageBuffers, props12.maxDescriptorSetUpdateAfterBindStorageBuffers});
+    Capacity[SamplerBinding] = SamplerCount;
+    while (Capacity[SampledImageBinding] + Capacity[StorageImageBinding] + Capacity[StorageBufferBinding] + SamplerCount > props12.maxPerStageUpdateAfterBindResources)
+    {
+        Capacity[SampledImageBinding] /= 2;
+        Capacity[StorageImageBinding] /= 2;
+        Capacity[StorageBufferBinding] /= 2;
+    }
+
+    Layout = DescriptorLayout::New(Vk, GetBindings(), LayoutFlags, BindingFlags);
+
+    std::vector<VkDescriptorPoolSize> sizes;
+    for (u32 i = 0; i < BindingCount; ++i)
+        sizes.push_back({.type = Types[i], .descriptorCount = Capacity[i]});
+
+    VkDescriptorPoolCreateInfo poolInfo = {
+        .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .flags         = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT,
+        .maxSets       = 1,
+        .poolSizeCount = (u32)sizes.size(),
+        .pPoolSizes    = sizes.data(),
+    };
+    NOSVK_ASSERT(Vk->CreateDescriptorPool(&poolInfo, 0, &Pool));
+
+    VkDescriptorSetAllocateInfo info = {
+        .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool     = Pool,
+        .descriptorSetCount = 1,
+        .pSetLayouts        = &Layout->Handle,
+    };
+    NOSVK_ASSERT(Vk->AllocateDescriptorSets(&info, &Set));
+
+    Write(SamplerBinding, NearestSampler, {.Image = {.sampler = Vk->GetSampler(VK_FILTER_NEAREST)}});
+    Write(SamplerBinding, LinearSampler, {.Image = {.sampler = Vk->GetSampler(VK_FILTER_LINEAR)}});
+}
+
+BindlessHeap::~BindlessHeap()
+{
+    Vk->DestroyDescriptorPool(Pool, 0);
+}
+
+bool BindlessHeap::Matches(std::map<u32, NamedDSLBinding> const& set)
+{
+    if (set.empty())
+        return false;
+    for (auto& [i, b] : set)
+    {
+        if (i >= BindingCount || Types[i] != b.DescriptorType)
+            return false;
+        if (SamplerBinding != i && -1 != b.DescriptorCount)
+            return false;
+    }
+    return true;
+}
+
+std::map<u32, NamedDSLBinding> BindlessHeap::GetBindings(std::map<u32, NamedDSLBinding> const& set) const
+{
+    std::map<u32, NamedDSLBinding> bindings;
+    for (u32 i = 0; i < BindingCount; ++i)
+    {
+        auto it = set.find(i);
+        NamedDSLBinding b = set.end() != it ? it->second : NamedDSLBinding{};
+        b.Binding = i;
+        b.DescriptorType = Types[i];
+        b.DescriptorCount = Capacity[i];
+        b.StageMask = VK_SHADER_STAGE_ALL;
+        bindings[i] = std::move(b);
+    }
+    return bindings;
+}
+
+u32 BindlessHeap::Allocate(u32 binding)
+{
+    if (!FreeIndices[binding].empty())
+    {
+        u32 index = FreeIndices[binding].back();
+        FreeIndices[binding].pop_back();
+        return index;
+    }
+    if (Next[binding] == Capacity[binding])
+    {
+        static const char* names[BindingCount] = {"sampled image", "storage image", "storage buffer", "sampler"};
+        GLog.E("Bindless heap is out of %s slots (%u)", names[binding], Capacity[binding]);
+        return InvalidIndex;
+    }
+    return Next[binding]++;
+}
+
+void BindlessHeap::Write(u32 binding, u32 index, DescriptorResourceInfo const& info)
+{
+    VkWriteDescriptorSet write = {
+        .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet          = Set,
+        .dstBinding      = binding,
+        .dstArrayElement = index,
+        .descriptorCount = 1,
+        .descriptorType  = Types[binding],
+        .pImageInfo      = &info.Image,
+        .pBufferInfo     = &info.Buffer,
+    };
+    Vk->UpdateDescriptorSets(1, &write, 0, 0);
+}
+
+u32 BindlessHeap::Register(ImageView* view, VkDescriptorType type)
+{
+    NOSVK_ASSERT(VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE == type || VK_DESCRIPTOR_TYPE_STORAGE_IMAGE == type);
+    u32 binding = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE == type ? StorageImageBinding : SampledImageBinding;
+    VkImageUsageFlags usage = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE == type ? VK_IMAGE_USAGE_STORAGE_BIT : VK_IMAGE_USAGE_SAMPLED_BIT;
+    if (!(view->Usage & usage))
+    {
+        GLog.E("Bindless heap: Image view without %s usage can not be registered", VK_DESCRIPTOR_TYPE_STORAGE_IMAGE == type ? "storage" : "sampled");
+        return InvalidIndex;
+    }
+    std::unique_lock lock(Mutex);
+    u32& index = view->BindlessIndex[binding];
+    if (InvalidIndex == index && InvalidIndex != (index = Allocate(binding)))
+        Write(binding, index, {.Image = {.imageView = view->Handle, .imageLayout = Binding::MapTypeToLayout(type)}});
+    return index;
+}
+
+u32 BindlessHeap::Register(Buffer* buffer)
+{
+    if (!(buffer->Usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT))
+    {
+        GLog.E("Bindless heap: Buffer without storage usage can not be registered");
+        return InvalidIndex;
+    }
+    std::unique_lock lock(Mutex);
+    u32& index = buffer->BindlessIndex;
+    if (InvalidIndex == index && InvalidIndex != (index = Allocate(StorageBufferBinding)))
+        Write(StorageBufferBinding, index, buffer->GetDescriptorInfo());
+    return index;
+}
+
+void BindlessHeap::Unregister(u32 binding, u32 index)
+{
+    // The slot keeps its stale descriptor until it is reused, which PARTIALLY_BOUND allows as long as
+    // shaders no longer index it. GetBindlessIndex retains the resource in every command buffer that
+    // takes its index, so it is only destroyed, and its slot freed, once those have completed.
+    std::unique_lock lock(Mutex);
+    FreeIndices[binding].push_back(index);
+}
+
+void BindlessHeap::Bind(rc<CommandBuffer> Cmd, VkPipelineBindPoint BindPoint, VkPipelineLayout PipelineLayout, u32 SetIndex)
+{
+    Cmd->BindDescriptorSets(BindPoint, PipelineLayout, SetIndex, 1, &Set, 0, 0);
+}
+
+u32 BindlessHeap::GetRegisteredCount(u32 binding)
+{
+    std::unique_lock lock(Mutex);
+    return Next[binding] - (u32)FreeIndices[binding].size();
+}
+
+} // namespace nos::vk
@@ -4,6 +4,7 @@
 #include "nosVulkan/Buffer.h"
 #include "nosVulkan/Device.h"
 #include "nosVulkan/Command.h"
+#include "nosVulkan/Bindless.h"
 
 namespace nos::vk
 {
@@ -35,6 +36,14 @@ Buffer::Buffer(Device* Vk, BufferCreateInfo const& info)
 		.usage = info.Usage,
 	};
 
+	// Buffer descriptors are written from device addresses
+	constexpr VkBufferUsageFlags descriptorUsage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+	if (Vk->DescriptorBuffers && (Usage & descriptorUsage))
+	{
+		Usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+		bufferCreateInfo.usage = Usage;
+	}
+
 	VkMemoryPropertyFlags memProps = 0;
 	if (AllocationInfo->MemProps.VRAM)
 		memProps |= VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
@@ -123,33 +132,98 @@ void Buffer::Upload(rc<CommandBuffer> Cmd, rc<Buffer> Src, const VkBufferCopy* R
     Cmd->CopyBuffer(Src->Handle, this->Handle, 1, Region);
 }
 
+void Buffer::Upload(rc<CommandBuffer> Cmd, const void* data, VkDeviceSize size, VkDeviceSize dstOffset)
+{
+    assert(Usage & VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+
+    auto ring = Vk->GetStagingRing();
+    auto staging = ring->Allocate(size);
+    memcpy(staging.Data(), data, size);
+
+    VkBufferCopy region = {
+        .srcOffset = staging.Offset,
+        .dstOffset = dstOffset,
+        .size      = size,
+    };
+
+    // Host writes are visible to the transfer once the command buffer is submitted, the ring itself needs no barrier
+    Transition(Cmd, BufferMemoryState{.StageMask = VK_PIPELINE_STAGE_2_TRANSFER_BIT, .AccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT}, dstOffset, size);
+    Cmd->CopyBuffer(staging.Buffer->Handle, this->Handle, 1, &region);
+    ring->Release(Cmd, staging);
+}
+
 void Buffer::Transition(rc<CommandBuffer> cmd, BufferMemoryState dst, VkDeviceSize offset, VkDeviceSize size)
 {
+	u32 family = cmd->Pool->PoolQueue->Family;
+	std::pair<u32, u32> families = {VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED};
+	if (!IsOwnedBy(family))
+		families = AcquireOwnership(family, false);
+	QueueFamily = family;
+	bool readAfterRead = families.first == families.second && !IsBarrierNeeded(State.AccessMask, dst.AccessMask);
+	if (readAfterRead && (!LastWrite.StageMask || IsReadCovered(State.StageMask, State.AccessMask, dst.StageMask, dst.AccessMask)))
+	{
+		// Later writers still have to wait for every reader
+		State.StageMask |= dst.StageMask;
+		State.AccessMask |= dst.AccessMask;
+		cmd->AddDependency(shared_from_this());
+		return;
+	}
+	// Readers in stages the last barrier did not cover wait on the last write themselves
+	BufferMemoryState src = readAfterRead ? BufferMemoryState{.StageMask = LastWrite.StageMask, .AccessMask = LastWrite.AccessMask} : State;
 	if (Vk->Features.synchronization2)
 	{
 		VkBufferMemoryBarrier2 barrier {
 			.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
-			.srcStageMask = State.StageMask,
-			.srcAccessMask = State.AccessMask,
+			.srcStageMask = src.StageMask,
+			.srcAccessMask = src.AccessMask,
 			.dstStageMask = dst.StageMask,
 			.dstAccessMask = dst.AccessMask,
+			.srcQueueFamilyIndex = families.first,
+			.dstQueueFamilyIndex = families.second,
 			.buffer = this->Handle,
-			.offset = offset,
-			.size = size,
-		};
-		VkDependencyInfo depInfo = {
-			.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
-			.dependencyFlags = VK_DEPENDENCY_DEVICE_GROUP_BIT,
-			.bufferMemoryBarrierCount = 1,
-			.pBufferMemoryBarriers = &barrier,
+			.offset = families.first != families.second ? 0 : offset,
+			.size = families.first != families.second ? VK_WHOLE_SIZE : size,
 		};
-		cmd->PipelineBarrier2(&depInfo);
+		cmd->AddBarrier(barrier);
 	}
 	else
 	{
 		GLog.E("BufferTransition: Memory barriers are currently only implemented for synchronization2!");
 	}
-	State = dst;
+	if (readAfterRead)
+	{
+		State.StageMask |= dst.StageMask;
+		State.AccessMask |= dst.AccessMask;
+	}
+	else
+	{
+		LastWrite = GetWriteScope(State.StageMask, State.AccessMask, dst.StageMask, dst.AccessMask);
+		State = dst;
+	}
+	cmd->AddDependency(shared_from_this());
+}
+
+void Buffer::ReleaseOwnership(rc<CommandBuffer> cmd, u32 dstFamily)
+{
+	u32 family = cmd->Pool->PoolQueue->Family;
+	if (dstFamily == family || VK_QUEUE_FAMILY_IGNORED == QueueFamily)
+		return;
+	assert(family == QueueFamily);
+	VkBufferMemoryBarrier2 barrier{
+		.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+		.srcStageMask = State.StageMask,
+		.srcAccessMask = State.AccessMask,
+		.dstStageMask = VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT,
+		.dstAccessMask = 0,
+		.srcQueueFamilyIndex = family,
+		.dstQueueFamilyIndex = dstFamily,
+		.buffer = this->Handle,
+		.offset = 0,
+		.size = VK_WHOLE_SIZE,
+	};
+	cmd->AddBarrier(barrier);
+	State = {.StageMask = VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT, .AccessMask = 0};
+	OwnershipReleased = true;
 	cmd->AddDependency(shared_from_this());
 }
 
@@ -178,8 +252,32 @@ DescriptorResourceInfo Buffer::GetDescriptorInfo() const
         }};
 }
 
+VkDeviceAddress Buffer::GetAddress() const
+{
+    VkBufferDeviceAddressInfo info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+        .buffer = Handle,
+    };
+    return Vk->GetBufferDeviceAddress(&info);
+}
+
+void Buffer::DiscardContents()
+{
+	ResetOwnership();
+	State = {.StageMask = VK_PIPELINE_STAGE_2_NONE, .AccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT};
+	LastWrite = {};
+}
+
+u32 Buffer::GetBindlessIndex(rc<CommandBuffer> Cmd)
+{
+    Cmd->AddDependency(shared_from_this());
+    return Vk->GetBindlessHeap()->Register(this);
+}
+
 Buffer::~Buffer()
 {
+    if (~0u != BindlessIndex)
+        Vk->Bindless->Unregister(BindlessHeap::StorageBufferBinding, BindlessIndex);
     if (AllocationInfo)
     {
         if (AllocationInfo->Imported)
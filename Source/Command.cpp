@@ -1,10 +1,16 @@
 // Copyright MediaZ Teknoloji A.S. All Rights Reserved.
 
 #include "nosVulkan/Command.h"
+#include "nosVulkan/CompletionDispatcher.h"
 #include "nosVulkan/Device.h"
 #include "nosVulkan/Image.h"
 #include "vkl.h"
 
+#include <algorithm>
+#include <set>
+
+#undef CreateSemaphore
+
 namespace nos::vk
 {
 
@@ -15,10 +21,211 @@ VkResult Queue::Submit(uint32_t submitCount, const VkSubmitInfo* pSubmits, VkFen
     return VklQueueFunctions::Submit(submitCount, pSubmits, fence);
 }
 
-VkResult Queue::Submit(std::vector<rc<CommandBuffer>> const& cmd)
+VkResult Queue::Submit(std::vector<rc<CommandBuffer>> const& cmds)
 {
-   std::vector<VkSubmitInfo> infos(cmd.size());
-   return Submit(infos.size(), infos.data(), 0);
+    return SubmitBatch(cmds, VK_NULL_HANDLE, 0);
+}
+
+VkResult Queue::SubmitBatch(std::vector<rc<CommandBuffer>> const& cmds, VkSemaphore signal, u64 signalValue)
+{
+    std::vector<rc<CommandBuffer>> ready;
+    ready.reserve(cmds.size());
+    for (auto& cmd : cmds)
+    {
+        if (!cmd->PrepareSubmit())
+            continue;
+        assert(cmd->Pool->PoolQueue.get() == this);
+        assert(cmd->Level == VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+        ready.push_back(cmd);
+    }
+    if (ready.empty() && !signal)
+        return VK_SUCCESS;
+
+    // Values of a pool timeline must reach the queue in increasing order, so every pool in the batch
+    // stays locked until the batch is queued. Locking in address order keeps concurrent batches deadlock free.
+    std::vector<CommandPool*> pools;
+    for (auto& cmd : ready)
+        pools.push_back(cmd->Pool);
+    std::sort(pools.begin(), pools.end());
+    pools.erase(std::unique(pools.begin(), pools.end()), pools.end());
+    for (auto pool : pools)
+        pool->Mutex.lock();
+
+    VkFence fence = ready.empty() ? VK_NULL_HANDLE : ready.back()->Fence;
+    size_t waitCount = 0, signalCount = 0;
+    for (auto& cmd : ready)
+    {
+        waitCount += cmd->WaitGroup.size();
+        signalCount += cmd->SignalGroup.size() + 1;
+    }
+
+    VkResult res;
+    if (GetDevice()->Features.synchronization2)
+    {
+        std::vector<VkSemaphoreSubmitInfo> waits;
+        std::vector<VkSemaphoreSubmitInfo> signals;
+        std::vector<VkCommandBufferSubmitInfo> cmdInfos(ready.size());
+        std::vector<VkSubmitInfo2> submits(ready.size());
+        waits.reserve(waitCount);
+        signals.reserve(signalCount);
+
+        for (size_t i = 0; i < ready.size(); ++i)
+        {
+            auto& cmd = ready[i];
+            cmd->SubmitValue = ++cmd->Pool->LastSubmittedValue;
+
+            auto firstWait = waits.size();
+            for (auto& [sema, p] : cmd->WaitGroup)
+                waits.push_back(VkSemaphoreSubmitInfo{
+                    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                    .semaphore = sema,
+                    .value = p.first,
+                    .stageMask = p.second,
+                });
+
+            auto firstSignal = signals.size();
+            for (auto& [sema, val] : cmd->SignalGroup)
+                signals.push_back(VkSemaphoreSubmitInfo{
+                    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                    .semaphore = sema,
+                    .value = val,
+                    .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                });
+            signals.push_back(VkSemaphoreSubmitInfo{
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                .semaphore = cmd->Pool->Timeline,
+                .value = cmd->SubmitValue,
+                .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+            });
+
+            cmdInfos[i] = VkCommandBufferSubmitInfo{
+                .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+                .commandBuffer = cmd->handle,
+            };
+            submits[i] = VkSubmitInfo2{
+                .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+                .waitSemaphoreInfoCount = u32(waits.size() - firstWait),
+                .pWaitSemaphoreInfos = waits.data() + firstWait,
+                .commandBufferInfoCount = 1,
+                .pCommandBufferInfos = &cmdInfos[i],
+                .signalSemaphoreInfoCount = u32(signals.size() - firstSignal),
+                .pSignalSemaphoreInfos = signals.data() + firstSignal,
+            };
+        }
+
+        // The extra signal goes last so it is ordered after every command buffer of the batch
+        VkSemaphoreSubmitInfo extraSignal = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+            .semaphore = signal,
+            .value = signalValue,
+            .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+        };
+        if (signal)
+            submits.push_back(VkSubmitInfo2{
+                .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+                .signalSemaphoreInfoCount = 1,
+                .pSignalSemaphoreInfos = &extraSignal,
+            });
+
+        std::unique_lock lock(Mutex);
+        GetDevice()->SubmitCount += submits.size();
+        res = Submit2((u32)submits.size(), submits.data(), fence);
+    }
+    else
+    {
+        std::vector<VkSemaphore> waits, signals;
+        std::vector<VkPipelineStageFlags> stages;
+        std::vector<uint64_t> waitValues, signalValues;
+        std::vector<VkTimelineSemaphoreSubmitInfo> timelineInfos(ready.size());
+        std::vector<VkSubmitInfo> submits(ready.size());
+        waits.reserve(waitCount);
+        stages.reserve(waitCount);
+        waitValues.reserve(waitCount);
+        signals.reserve(signalCount);
+        signalValues.reserve(signalCount);
+
+        for (size_t i = 0; i < ready.size(); ++i)
+        {
+            auto& cmd = ready[i];
+            cmd->SubmitValue = ++cmd->Pool->LastSubmittedValue;
+
+            auto firstWait = waits.size();
+            for (auto& [sema, p] : cmd->WaitGroup)
+            {
+                waits.push_back(sema);
+                waitValues.push_back(p.first);
+                stages.push_back(p.second);
+            }
+
+            auto firstSignal = signals.size();
+            for (auto& [sema, val] : cmd->SignalGroup)
+            {
+                signals.push_back(sema);
+                signalValues.push_back(val);
+            }
+            signals.push_back(cmd->Pool->Timeline);
+            signalValues.push_back(cmd->SubmitValue);
+
+            timelineInfos[i] = VkTimelineSemaphoreSubmitInfo{
+                .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+                .waitSemaphoreValueCount = u32(waits.size() - firstWait),
+                .pWaitSemaphoreValues = waitValues.data() + firstWait,
+                .signalSemaphoreValueCount = u32(signals.size() - firstSignal),
+                .pSignalSemaphoreValues = signalValues.data() + firstSignal,
+            };
+            submits[i] = VkSubmitInfo{
+                .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                .pNext = &timelineInfos[i],
+                .waitSemaphoreCount = u32(waits.size() - firstWait),
+                .pWaitSemaphores = waits.data() + firstWait,
+                .pWaitDstStageMask = stages.data() + firstWait,
+                .commandBufferCount = 1,
+                .pCommandBuffers = &cmd->handle,
+                .signalSemaphoreCount = u32(signals.size() - firstSignal),
+                .pSignalSemaphores = signals.data() + firstSignal,
+            };
+        }
+
+        VkTimelineSemaphoreSubmitInfo extraTimeline = {
+            .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+            .signalSemaphoreValueCount = 1,
+            .pSignalSemaphoreValues = &signalValue,
+        };
+        if (signal)
+            submits.push_back(VkSubmitInfo{
+                .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                .pNext = &extraTimeline,
+                .signalSemaphoreCount = 1,
+                .pSignalSemaphores = &signal,
+            });
+
+        res = Submit((u32)submits.size(), submits.data(), fence);
+    }
+
+    if (NOS_VULKAN_SUCCEEDED(res))
+    {
+        for (auto& cmd : ready)
+        {
+            cmd->State = CommandBuffer::Pending;
+            cmd->Pool->PendingBuffers.emplace_back(cmd->SubmitValue, cmd);
+        }
+        if (auto completions = GetDevice()->GetCompletions())
+            for (auto& cmd : ready)
+                completions->Track(cmd);
+    }
+    else
+    {
+        // Nothing was queued, give the values back so waits on the pool timelines can still complete
+        for (auto& cmd : ready)
+        {
+            --cmd->Pool->LastSubmittedValue;
+            cmd->SubmitValue = 0;
+        }
+    }
+
+    for (auto pool : pools)
+        pool->Mutex.unlock();
+    return res;
 }
 
 Queue::Queue(Device* Device, u32 Family, u32 Index)
@@ -27,28 +234,185 @@ Queue::Queue(Device* Device, u32 Family, u32 Index)
     Device->GetDeviceQueue(Family, Index, &handle);
 }
 
-Device* Queue::GetDevice()
+Queue::~Queue()
+{
+    // The device stops the submit threads before it goes away, this only catches queues created outside of it
+    if (SubmitThread.joinable())
+        StopSubmitThread();
+}
+
+void Queue::StartSubmitThread(std::chrono::microseconds coalesceWindow, u32 maxBatch)
 {
+    if (SubmitThread.joinable())
+        return;
 
-    return static_cast<Device*>(fnptrs);
+    VkSemaphoreTypeCreateInfo timelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = 0,
+    };
+
+    VkSemaphoreCreateInfo semaphoreInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &timelineInfo,
+    };
+
+    NOSVK_ASSERT(GetDevice()->CreateSemaphore(&semaphoreInfo, 0, &TicketTimeline));
+
+    CoalesceWindow = coalesceWindow;
+    MaxSubmitBatch = std::max(maxBatch, 1u);
+    NextTicket = 0;
+    SubmittedTicket = 0;
+    StopSubmit = false;
+    SubmitThread = std::thread([this] { SubmitThreadMain(); });
 }
 
-CommandBuffer::CommandBuffer(CommandPool* Pool, VkCommandBuffer Handle)
-    : VklCommandFunctions{Pool->GetDevice(), Handle}, Pool(Pool)
+void Queue::StopSubmitThread()
 {
+    if (!SubmitThread.joinable())
+        return;
+
+    StopSubmit = true;
+    SubmitWake.fetch_add(1, std::memory_order_release);
+    SubmitWake.notify_one();
+    SubmitWakeCV.notify_one();
+    SubmitThread.join();
+
+    // Pushes that raced the stop are still queued, submit them here. Every ticket handed out is then either
+    // submitted or drained, so the timeline moves past the gaps the worker could not close.
+    std::vector<rc<CommandBuffer>> rest;
+    SubmitRequest req;
+    while (PendingSubmits.TryPop(req))
+        rest.push_back(std::move(req.Cmd));
+    u64 last = NextTicket.load();
+    if (!rest.empty() || last > SubmittedTicket)
+    {
+        NOSVK_ASSERT(SubmitBatch(rest, TicketTimeline, last));
+        SubmittedTicket = last;
+    }
 
-    VkFenceCreateInfo fenceInfo = {
-        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-        .flags = VK_FENCE_CREATE_SIGNALED_BIT,
+    WaitForTicket(SubmittedTicket);
+    GetDevice()->DestroySemaphore(TicketTimeline, 0);
+    TicketTimeline = VK_NULL_HANDLE;
+}
+
+u64 Queue::SubmitAsync(rc<CommandBuffer> cmd)
+{
+    if (!SubmitThread.joinable())
+    {
+        GLog.W("Queue::SubmitAsync: Submit thread is not running, submitting on the calling thread");
+        NOSVK_ASSERT(Submit({cmd}));
+        return 0;
+    }
+
+    u64 ticket = ++NextTicket;
+    PendingSubmits.Push({std::move(cmd), ticket});
+    SubmitWake.fetch_add(1, std::memory_order_release);
+    SubmitWake.notify_one();
+    SubmitWakeCV.notify_one();
+    return ticket;
+}
+
+bool Queue::WaitForTicket(u64 ticket, u64 timeoutNs)
+{
+    if (!ticket || !TicketTimeline)
+        return true;
+    VkSemaphoreWaitInfo waitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = 1,
+        .pSemaphores = &TicketTimeline,
+        .pValues = &ticket,
     };
-    
-    NOSVK_ASSERT(GetDevice()->CreateFence(&fenceInfo, 0, &Fence));
+    return GetDevice()->WaitSemaphores(&waitInfo, timeoutNs) == VK_SUCCESS;
+}
+
+u64 Queue::GetCompletedTicket()
+{
+    if (!TicketTimeline)
+        return 0;
+    u64 value = 0;
+    NOSVK_ASSERT(GetDevice()->GetSemaphoreCounterValue(TicketTimeline, &value));
+    return value;
+}
+
+void Queue::SubmitThreadMain()
+{
+    std::vector<rc<CommandBuffer>> batch;
+    // Tickets are taken before the push, so they can be popped slightly out of order.
+    // The timeline is only advanced over the contiguous range that has been submitted.
+    std::set<u64> submitted;
+    u64 seen = SubmitWake.load(std::memory_order_acquire);
+    SubmitRequest req;
+    auto woken = [&] { return SubmitWake.load(std::memory_order_acquire) != seen || StopSubmit; };
+
+    while (true)
+    {
+        if (PendingSubmits.Empty())
+        {
+            if (StopSubmit)
+                break;
+            // A push that misses the Empty check bumps SubmitWake past seen, so the wait returns at once
+            SubmitWake.wait(seen, std::memory_order_acquire);
+            seen = SubmitWake.load(std::memory_order_acquire);
+            continue;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + CoalesceWindow;
+        while (batch.size() < MaxSubmitBatch)
+        {
+            if (PendingSubmits.TryPop(req))
+            {
+                batch.push_back(std::move(req.Cmd));
+                submitted.insert(req.Ticket);
+                continue;
+            }
+            if (!batch.empty() && (StopSubmit || std::chrono::steady_clock::now() >= deadline))
+                break;
+            // Sleeps until the next push or the end of the coalesce window
+            if (batch.empty())
+                SubmitWake.wait(seen, std::memory_order_acquire);
+            else
+            {
+                std::unique_lock lock(SubmitWakeMutex);
+                SubmitWakeCV.wait_until(lock, deadline, woken);
+            }
+            seen = SubmitWake.load(std::memory_order_acquire);
+        }
+
+        u64 signalValue = SubmittedTicket;
+        while (!submitted.empty() && *submitted.begin() == signalValue + 1)
+        {
+            submitted.erase(submitted.begin());
+            ++signalValue;
+        }
+
+        NOSVK_ASSERT(SubmitBatch(batch, signalValue != SubmittedTicket ? TicketTimeline : VK_NULL_HANDLE, signalValue));
+        SubmittedTicket = signalValue;
+        batch.clear();
+    }
+}
+
+Device* Queue::GetDevice()
+{
+
+    return static_cast<Device*>(fnptrs);
+}
+
+CommandBuffer::CommandBuffer(CommandPool* Pool, VkCommandBuffer Handle, VkCommandBufferLevel Level)
+    : VklCommandFunctions{Pool->GetDevice(), Handle}, Pool(Pool), Level(Level)
+{
+    PooledFence = GetDevice()->ResourcePools.Fence->Get(0, "CommandBuffer");
+    Fence = PooledFence->Handle;
 	Clear();
 }
 
 bool CommandBuffer::Wait(uint64_t timeOutNs)
 {
-	if (GetDevice()->WaitForFences(1, &Fence, 0, timeOutNs) != VK_SUCCESS)
+	if (State != Pending)
+		return State == Initial;
+	// A pool waits for its timeline before detaching its buffers, so without one the work is done
+	bool done = !Pool || Pool->WaitForValue(SubmitValue, timeOutNs);
+	if (!done)
     {
 		GLog.W("Command buffer wait timeout!");
         return false;
@@ -59,19 +423,51 @@ bool CommandBuffer::Wait(uint64_t timeOutNs)
 
 void CommandBuffer::WaitAndClear()
 {
-	if (State == Pending && GetDevice()->WaitForFences(1, &Fence, 0, UINT64_MAX) != VK_SUCCESS)
-        GLog.E("Clearing command buffer without finishing: Thread %d", std::this_thread::get_id());
+	if (State == Pending)
+	{
+		bool done = !Pool || Pool->WaitForValue(SubmitValue);
+		if (!done)
+			GLog.E("Clearing command buffer without finishing: Thread %d", std::this_thread::get_id());
+	}
 	Clear();
 }
 
+bool CommandBuffer::IsComplete()
+{
+	if (State != Pending)
+		return false;
+	// Batched submissions only signal the fence of their last buffer, the pool timeline covers all of them
+	return !Pool || Pool->GetCompletedValue() >= SubmitValue;
+}
+
 void CommandBuffer::Clear()
 {
+    if (Dispatched)
+    {
+        // Runs the work here if the dispatcher has not started it. A callback that clears a buffer on the
+        // dispatcher thread neither waits for work queued behind itself nor for its own completion.
+        Dispatched->Run();
+        if (Dispatched->Runner.load() != std::this_thread::get_id())
+            Dispatched->Done.wait(false);
+    }
 	NOSVK_ASSERT(GetDevice()->ResetFences(1, &Fence));
-	NOSVK_ASSERT(VklCommandFunctions::Reset(VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT));
+	// Without a pool the handle went away with the VkCommandPool
+	if (Pool)
+		NOSVK_ASSERT(VklCommandFunctions::Reset(VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT));
+    // Retained images get their end state before callbacks hand them back to pools
+    Retained.Release();
     for (auto& fn : Callbacks) fn();
     Callbacks.clear();
+    for (auto& sec : Secondaries)
+        sec->ReturnToPool();
+    Secondaries.clear();
     WaitGroup.clear();
     SignalGroup.clear();
+    PendingImageBarriers.clear();
+    PendingBufferBarriers.clear();
+    DescriptorBufferAddress = 0;
+    static std::atomic<u64> NextRecording = 0;
+    RecordingEpoch = ++NextRecording;
 	State = Initial;
 }
 
@@ -90,16 +486,209 @@ VkResult CommandBuffer::End()
 {
     if (!Pool || Recording != State)
         return VK_INCOMPLETE;
+    FlushBarriers();
     VkResult re = VklCommandFunctions::End();
     State = Executable;
     return re;
 }
 
+void CommandBuffer::WaitFor(rc<CommandBuffer> Other, VkPipelineStageFlags Stage)
+{
+    if (!Other->Pool || Pending != Other->State)
+        return; // Already complete or never submitted
+    auto& [value, stages] = WaitGroup[Other->Pool->Timeline];
+    value = std::max(value, Other->SubmitValue);
+    stages |= Stage;
+}
+
+namespace detail
+{
+uint64_t GetTimelineValue(vk::Device* device, VkSemaphore timeline)
+{
+    uint64_t value = 0;
+    NOSVK_ASSERT(device->GetSemaphoreCounterValue(timeline, &value));
+    return value;
+}
+} // namespace detail
+
+bool RetainList::Insert(void* key, u32& slot)
+{
+    if ((Entries.size() + 1) * 2 > Slots.size())
+        Rehash(std::max<size_t>(64, Slots.size() * 2));
+
+    size_t mask = Slots.size() - 1;
+    // Pointers are aligned, mix the upper bits down before masking
+    size_t i = ((uintptr_t(key) >> 4) * 0x9E3779B97F4A7C15ull >> 32) & mask;
+    while (Slots[i])
+    {
+        if (Slots[i] == key)
+            return false;
+        i = (i + 1) & mask;
+    }
+    Slots[i] = key;
+    slot = u32(i);
+    return true;
+}
+
+void RetainList::Rehash(size_t capacity)
+{
+    Slots.assign(capacity, nullptr);
+    size_t mask = capacity - 1;
+    for (auto& entry : Entries)
+    {
+        void* key = entry.Ref.get();
+        size_t i = ((uintptr_t(key) >> 4) * 0x9E3779B97F4A7C15ull >> 32) & mask;
+        while (Slots[i])
+            i = (i + 1) & mask;
+        Slots[i] = key;
+        entry.Slot = u32(i);
+    }
+}
+
+void RetainList::Release(bool runEnd)
+{
+    for (auto& entry : Entries)
+    {
+        if (entry.End && runEnd)
+            entry.End(entry.Ref.get());
+        Slots[entry.Slot] = nullptr;
+    }
+    Entries.clear();
+}
+
+void CommandBuffer::Execute(std::vector<rc<CommandBuffer>> const& secondaries)
+{
+    std::vector<VkCommandBuffer> handles;
+    handles.reserve(secondaries.size());
+    for (auto& sec : secondaries)
+    {
+        assert(sec->Level == VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+        for (auto& f : sec->PreSubmit)
+            f(sec);
+        sec->PreSubmit.clear();
+        if (Recording == sec->State)
+            NOSVK_ASSERT(sec->End());
+        if (Executable != sec->State)
+        {
+            GLog.W("Secondary command buffer is not executable, skipping");
+            continue;
+        }
+        for (auto& [sema, p] : sec->WaitGroup)
+        {
+            auto& [value, stages] = WaitGroup[sema];
+            value = std::max(value, p.first);
+            stages |= p.second;
+        }
+        for (auto& [sema, val] : sec->SignalGroup)
+            SignalGroup[sema] = std::max(SignalGroup[sema], val);
+        sec->WaitGroup.clear();
+        sec->SignalGroup.clear();
+        sec->Parent = weak_from_this();
+        handles.push_back(sec->handle);
+        Secondaries.push_back(sec);
+    }
+    if (!handles.empty())
+        ExecuteCommands((u32)handles.size(), handles.data());
+}
+
+void CommandBuffer::Completion::Run()
+{
+    if (Claimed.exchange(true))
+        return;
+    Runner = std::this_thread::get_id();
+    Retained.Release(false);
+    for (auto& fn : Callbacks) fn();
+    Callbacks.clear();
+    for (auto& sec : Secondaries)
+        sec->ReturnToPool(false);
+    Secondaries.clear();
+    Done = true;
+    Done.notify_all();
+}
+
+void CommandBuffer::ReturnToPool(bool runEnd)
+{
+    // Runs on whichever thread retires the primary, the handle is reset later by the owner of the pool
+    // Retained images get their end state before callbacks hand them back to pools
+    Retained.Release(runEnd);
+    for (auto& fn : Callbacks) fn();
+    Callbacks.clear();
+    Parent.reset();
+    if (Pool)
+        Pool->ReturnSecondary(shared_from_this());
+}
+
+void CommandBuffer::AddBarrier(VkImageMemoryBarrier2 const& barrier)
+{
+    // Barriers in one dependency are not ordered against each other, so a second transition
+    // of the same subresource before any work is folded into the pending one. Both consumers
+    // still need the memory to be visible, so the scopes are merged rather than replaced.
+    for (auto& pending : PendingImageBarriers)
+    {
+        auto& l = pending.subresourceRange;
+        auto& r = barrier.subresourceRange;
+        if (pending.image == barrier.image && l.aspectMask == r.aspectMask && l.baseMipLevel == r.baseMipLevel &&
+            l.levelCount == r.levelCount && l.baseArrayLayer == r.baseArrayLayer && l.layerCount == r.layerCount)
+        {
+            // Ownership transfers are not folded, they have to reach the queue as recorded
+            if (pending.srcQueueFamilyIndex != pending.dstQueueFamilyIndex || barrier.srcQueueFamilyIndex != barrier.dstQueueFamilyIndex)
+            {
+                FlushBarriers();
+                break;
+            }
+            pending.srcStageMask |= barrier.srcStageMask;
+            pending.srcAccessMask |= barrier.srcAccessMask;
+            pending.dstStageMask |= barrier.dstStageMask;
+            pending.dstAccessMask |= barrier.dstAccessMask;
+            pending.newLayout = barrier.newLayout;
+            return;
+        }
+    }
+    PendingImageBarriers.push_back(barrier);
+}
+
+void CommandBuffer::AddBarrier(VkBufferMemoryBarrier2 const& barrier)
+{
+    // Only identical ranges are folded, other ranges of the same buffer keep their own barrier
+    for (auto& pending : PendingBufferBarriers)
+    {
+        if (pending.buffer == barrier.buffer && pending.offset == barrier.offset && pending.size == barrier.size)
+        {
+            if (pending.srcQueueFamilyIndex != pending.dstQueueFamilyIndex || barrier.srcQueueFamilyIndex != barrier.dstQueueFamilyIndex)
+            {
+                FlushBarriers();
+                break;
+            }
+            pending.srcStageMask |= barrier.srcStageMask;
+            pending.srcAccessMask |= barrier.srcAccessMask;
+            pending.dstStageMask |= barrier.dstStageMask;
+            pending.dstAccessMask |= barrier.dstAccessMask;
+            return;
+        }
+    }
+    PendingBufferBarriers.push_back(barrier);
+}
+
+void CommandBuffer::FlushBarriers()
+{
+    if (PendingImageBarriers.empty() && PendingBufferBarriers.empty())
+        return;
+    VkDependencyInfo dependencyInfo = {
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .dependencyFlags = VK_DEPENDENCY_DEVICE_GROUP_BIT,
+        .bufferMemoryBarrierCount = (u32)PendingBufferBarriers.size(),
+        .pBufferMemoryBarriers = PendingBufferBarriers.data(),
+        .imageMemoryBarrierCount = (u32)PendingImageBarriers.size(),
+        .pImageMemoryBarriers = PendingImageBarriers.data(),
+    };
+    VklCommandFunctions::PipelineBarrier2(&dependencyInfo);
+    PendingImageBarriers.clear();
+    PendingBufferBarriers.clear();
+}
+
 void CommandBuffer::UpdatePendingState()
 {
-	if (State != Pending)
-		return;
-	if (GetDevice()->GetFenceStatus(Fence) != VK_SUCCESS)
+	if (!IsComplete())
 		return;
 	Clear();
 }
@@ -107,10 +696,12 @@ void CommandBuffer::UpdatePendingState()
 CommandBuffer::~CommandBuffer()
 {
     WaitAndClear();
-    GetDevice()->DestroyFence(Fence, 0);
+    // Destroyed along with PooledFence when the pools are already gone
+    if (auto& fences = GetDevice()->ResourcePools.Fence)
+        fences->Release(PooledFence);
 }
 
-rc<CommandBuffer> CommandBuffer::Submit()
+bool CommandBuffer::PrepareSubmit()
 {
     auto self = shared_from_this();
     for(auto& f : PreSubmit)
@@ -119,74 +710,33 @@ rc<CommandBuffer> CommandBuffer::Submit()
     }
     
     if (!Pool)
-		return 0;
+		return false;
 
     if (Recording == State)
     {
         NOSVK_ASSERT(End());
 
     }
-    if (Executable != State)
-        return 0;
-    std::vector<VkSemaphore> Signal;
-    std::vector<VkSemaphore> Wait;
-    std::vector<VkPipelineStageFlags> Stages;
-    std::vector<uint64_t> WaitValues;
-    std::vector<uint64_t> SignalValues;
-
-
-    Wait.reserve(WaitGroup.size());
-    WaitValues.reserve(WaitGroup.size());
-    Stages.reserve(WaitGroup.size());
-    Signal.reserve(Signal.size());
-    SignalValues.reserve(SignalGroup.size());
-    
-    for (auto [sema, val] : SignalGroup)
-    {
-        Signal.push_back(sema);
-        SignalValues.push_back(val);
-    }
+    return Executable == State;
+}
 
-    for (auto [sema, p] : WaitGroup)
+rc<CommandBuffer> CommandBuffer::Submit()
+{
+    auto self = shared_from_this();
+    if (!Pool)
     {
-        Wait.push_back(sema);
-        WaitValues.push_back(p.first);
-        Stages.push_back(p.second);
+        PrepareSubmit();
+        return 0;
     }
-
-    VkTimelineSemaphoreSubmitInfo timelineInfo = {
-      .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
-      .waitSemaphoreValueCount   = (u32)WaitValues.size(),
-      .pWaitSemaphoreValues      = WaitValues.data(),
-      .signalSemaphoreValueCount = (u32)SignalValues.size(),
-      .pSignalSemaphoreValues    = SignalValues.data(),
-    };
-    
-    VkSubmitInfo submitInfo = {
-        .sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .pNext                = &timelineInfo,
-        .waitSemaphoreCount   = (u32)Wait.size(),
-        .pWaitSemaphores      = Wait.data(),
-        .pWaitDstStageMask    = Stages.data(),
-        .commandBufferCount   = 1,
-        .pCommandBuffers      = &handle,
-        .signalSemaphoreCount = (u32)Signal.size(),
-        .pSignalSemaphores    = Signal.data(),
-    };
-
-	auto res = Pool->Submit(1, &submitInfo, Fence);
-    NOSVK_ASSERT(res);
-    State = Pending;
-    return self;
+    NOSVK_ASSERT(Pool->PoolQueue->Submit({self}));
+    return Pending == State ? self : 0;
 }
 
 bool CommandBuffer::IsFree()
 {
 	if (State == Initial)
 		return true;
-	if (State != Pending)
-		return false;
-    if (GetDevice()->GetFenceStatus(Fence) == VK_SUCCESS)
+    if (IsComplete())
     {
 		Clear();
 		return true;
@@ -200,33 +750,31 @@ Device* CommandBuffer::GetDevice()
 }
 
 CommandPool::CommandPool(Device* Vk, rc<vk::Queue> queue, u64 PoolSize)
-    : PoolQueue(queue), NextBuffer(PoolSize)
+    : PoolQueue(queue)
 {
     VkCommandPoolCreateInfo info = {
         .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
         .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
-        .queueFamilyIndex = PoolQueue->Idx,
+        .queueFamilyIndex = PoolQueue->Family,
     };
 
     NOSVK_ASSERT(Vk->CreateCommandPool(&info, 0, &Handle));
 
-    std::vector<VkCommandBuffer> buf(PoolSize);
- 
-    VkCommandBufferAllocateInfo cmdInfo = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .commandPool = Handle,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = (u32)PoolSize,
+    VkSemaphoreTypeCreateInfo timelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = 0,
     };
 
-    NOSVK_ASSERT(Vk->AllocateCommandBuffers(&cmdInfo, buf.data()));
+    VkSemaphoreCreateInfo semaphoreInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &timelineInfo,
+    };
 
-    Buffers.reserve(PoolSize);
+    NOSVK_ASSERT(Vk->CreateSemaphore(&semaphoreInfo, 0, &Timeline));
 
-    for (VkCommandBuffer cmd : buf)
-    {
-        Buffers.emplace_back(CommandBuffer::New(this, cmd));
-    }
+    MaxPoolSize = std::max(MaxPoolSize, PoolSize);
+    Grow(PoolSize);
 }
 
 CommandPool::CommandPool(Device* Vk)
@@ -234,6 +782,11 @@ CommandPool::CommandPool(Device* Vk)
 {
 }
 
+CommandPool::CommandPool(Device* Vk, QueueType type, u64 PoolSize)
+    : CommandPool(Vk, Vk->GetQueue(type), PoolSize)
+{
+}
+
 Device* CommandPool::GetDevice()
 {
     return PoolQueue->GetDevice();
@@ -241,50 +794,204 @@ Device* CommandPool::GetDevice()
 
 CommandPool::~CommandPool()
 {
+    WaitForValue(LastSubmittedValue);
+    {
+        // Batched submissions only signal the fence of their last command buffer, retire everything through the timeline
+        std::unique_lock lock(Mutex);
+        RetireCompleted(LastSubmittedValue);
+    }
+
     for(auto& cmd : Buffers)
         cmd->Pool = 0;
 
+    for (auto& cmd : SecondaryBuffers)
+    {
+        // Secondaries executed by primaries of other pools must be done on the device before the pool goes away
+        auto parent = cmd->Parent.lock();
+        if (parent && parent->Pool && CommandBuffer::Pending == parent->State)
+            parent->Pool->WaitForValue(parent->SubmitValue);
+        else if (parent)
+            GLog.W("Command pool destroyed while one of its secondaries is executed by an unsubmitted primary");
+        cmd->Pool = 0;
+    }
+    {
+        std::unique_lock lock(SecondaryMutex);
+        ReturnedSecondaries.clear();
+    }
+
+    FreeSecondaries.clear();
+    SecondaryBuffers.clear();
+    FreeBuffers.clear();
+    PendingBuffers.clear();
     Buffers.clear();
+    GetDevice()->DestroySemaphore(Timeline, 0);
     GetDevice()->DestroyCommandPool(Handle, 0);
 }
 
-uint64_t NowInUs()
+void CommandPool::Grow(u64 count, VkCommandBufferLevel level)
 {
-    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+    if (!count)
+        return;
+
+    std::vector<VkCommandBuffer> buf(count);
+
+    VkCommandBufferAllocateInfo cmdInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = Handle,
+        .level = level,
+        .commandBufferCount = (u32)count,
+    };
+
+    NOSVK_ASSERT(GetDevice()->AllocateCommandBuffers(&cmdInfo, buf.data()));
+
+    if (VK_COMMAND_BUFFER_LEVEL_SECONDARY == level)
+    {
+        for (VkCommandBuffer cmd : buf)
+        {
+            auto& added = SecondaryBuffers.emplace_back(CommandBuffer::New(this, cmd, level));
+            added->InFreeList = true;
+            FreeSecondaries.push_back(added);
+        }
+        return;
+    }
+
+    Buffers.reserve(Buffers.size() + count);
+    FreeBuffers.reserve(Buffers.capacity());
+
+    for (VkCommandBuffer cmd : buf)
+    {
+        auto& added = Buffers.emplace_back(CommandBuffer::New(this, cmd));
+        added->InFreeList = true;
+        FreeBuffers.push_back(added);
+    }
 }
 
-rc<CommandBuffer> CommandPool::AllocCommandBuffer(VkCommandBufferLevel level)
+uint64_t CommandPool::GetCompletedValue()
+{
+    uint64_t value = 0;
+    NOSVK_ASSERT(GetDevice()->GetSemaphoreCounterValue(Timeline, &value));
+    return value;
+}
+
+bool CommandPool::WaitForValue(uint64_t value, uint64_t timeoutNs)
 {
-	auto now = NowInUs();
+    VkSemaphoreWaitInfo waitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = 1,
+        .pSemaphores = &Timeline,
+        .pValues = &value,
+    };
+    return GetDevice()->WaitSemaphores(&waitInfo, timeoutNs) == VK_SUCCESS;
+}
+
+void CommandPool::RetireCompleted(uint64_t completedValue)
+{
+    while (!PendingBuffers.empty() && PendingBuffers.front().first <= completedValue)
+    {
+        auto [value, cmd] = std::move(PendingBuffers.front());
+        PendingBuffers.pop_front();
+        // Resubmitted after an explicit Wait, a newer entry tracks it
+        if (cmd->SubmitValue != value || cmd->InFreeList)
+            continue;
+        if (cmd->State == CommandBuffer::Pending)
+            cmd->Clear();
+        if (cmd->State == CommandBuffer::Initial)
+        {
+            cmd->InFreeList = true;
+            FreeBuffers.push_back(std::move(cmd));
+        }
+    }
+}
+
+void CommandPool::ReclaimUntracked()
+{
+    // Buffers cleared by hand (e.g. discarded without submission) are not in any queue
     for (auto& cmd : Buffers)
     {
-		cmd->UpdatePendingState();
+        if (!cmd->InFreeList && cmd->State == CommandBuffer::Initial)
+        {
+            cmd->InFreeList = true;
+            FreeBuffers.push_back(cmd);
+        }
+    }
+}
+
+rc<CommandBuffer> CommandPool::AllocSecondary()
+{
+    std::vector<rc<CommandBuffer>> returned;
+    {
+        std::unique_lock lock(SecondaryMutex);
+        returned.swap(ReturnedSecondaries);
+    }
+
+    std::unique_lock lock(Mutex);
+    for (auto& cmd : returned)
+    {
+        cmd->Clear();
+        cmd->InFreeList = true;
+        FreeSecondaries.push_back(std::move(cmd));
     }
-	bool exhausted = false;
-	while (1)
-	{
-		auto cmd = Buffers[NextBuffer];
-		if (cmd->IsFree())
-			break;
-
-		NextBuffer++;
-		if (!exhausted)
-		{
-			auto elapsed = NowInUs() - now;
-			if (elapsed > 1e4) // log if exhausted for 10ms
-			{
-				GLog.W("Command pool is exhausted");
-				exhausted = true;
-			}
-		}
-	}
 
-    auto cmd = Buffers[NextBuffer];
+    if (FreeSecondaries.empty())
+        Grow(SecondaryGrowCount, VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+
+    auto cmd = std::move(FreeSecondaries.back());
+    FreeSecondaries.pop_back();
+    cmd->InFreeList = false;
+    return cmd;
+}
+
+void CommandPool::ReturnSecondary(rc<CommandBuffer> cmd)
+{
+    std::unique_lock lock(SecondaryMutex);
+    ReturnedSecondaries.push_back(std::move(cmd));
+}
+
+rc<CommandBuffer> CommandPool::AllocCommandBuffer(VkCommandBufferLevel level)
+{
+    if (VK_COMMAND_BUFFER_LEVEL_SECONDARY == level)
+        return AllocSecondary();
+
+    std::unique_lock lock(Mutex);
+    if (FreeBuffers.empty())
+        RetireCompleted(GetCompletedValue());
+
+    while (FreeBuffers.empty())
+    {
+        if (Buffers.size() < MaxPoolSize)
+        {
+            ReclaimUntracked();
+            if (FreeBuffers.empty())
+                Grow(std::max<u64>(1, std::min<u64>(Buffers.size(), MaxPoolSize - Buffers.size())));
+        }
+        else if (!PendingBuffers.empty())
+        {
+            // Block on the oldest submission instead of spinning over the pool
+            WaitForValue(PendingBuffers.front().first);
+            RetireCompleted(GetCompletedValue());
+        }
+        else
+        {
+            ReclaimUntracked();
+            if (FreeBuffers.empty())
+            {
+                GLog.W("Command pool has no submitted work to recycle, growing past %llu buffers", MaxPoolSize);
+                Grow(DefaultPoolSize);
+            }
+        }
+    }
+
+    auto cmd = std::move(FreeBuffers.back());
+    FreeBuffers.pop_back();
+    cmd->InFreeList = false;
     return cmd;
 }
 
 rc<CommandBuffer> CommandPool::BeginCmd(VkCommandBufferLevel level)
 {
+    if (VK_COMMAND_BUFFER_LEVEL_SECONDARY == level)
+        return BeginSecondaryCmd();
+
     rc<CommandBuffer> Cmd = AllocCommandBuffer(level);
 
     VkCommandBufferBeginInfo beginInfo = {
@@ -296,11 +1003,32 @@ rc<CommandBuffer> CommandPool::BeginCmd(VkCommandBufferLevel level)
     return Cmd;
 }
 
+rc<CommandBuffer> CommandPool::BeginSecondaryCmd(const VkCommandBufferInheritanceInfo* inheritance, VkCommandBufferUsageFlags flags)
+{
+    rc<CommandBuffer> Cmd = AllocCommandBuffer(VK_COMMAND_BUFFER_LEVEL_SECONDARY);
+
+    VkCommandBufferInheritanceInfo noInheritance = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+    };
+
+    VkCommandBufferBeginInfo beginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = flags,
+        .pInheritanceInfo = inheritance ? inheritance : &noInheritance,
+    };
+
+    NOSVK_ASSERT(Cmd->Begin(&beginInfo));
+    return Cmd;
+}
+
 void CommandPool::Clear()
 {
+    std::unique_lock lock(Mutex);
     for(auto& cmd : Buffers) 
         if(cmd->State != CommandBuffer::Initial) 
             cmd->WaitAndClear();
+    PendingBuffers.clear();
+    ReclaimUntracked();
 }
 
 } // namespace nos::vk
\ No newline at end of file
@@ -61,18 +61,17 @@ void ImageLayoutTransition(VkImage Image,
                            rc<CommandBuffer> Cmd,
                            ImageState Src,
                            ImageState Dst, 
-                           VkImageAspectFlags Aspect)
+                           VkImageAspectFlags Aspect,
+                           u32 SrcFamily,
+                           u32 DstFamily)
 {  
     
     VkImageMemoryBarrier imageMemoryBarrier = {
         .sType               = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
         .oldLayout           = Src.Layout,
         .newLayout           = Dst.Layout,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL,
-        //.dstQueueFamilyIndex = Cmd->Pool->Queue->Family,
-        // .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        // .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .srcQueueFamilyIndex = SrcFamily,
+        .dstQueueFamilyIndex = DstFamily,
         .image               = Image,
         .subresourceRange    = {
                .aspectMask   = Aspect,
@@ -91,7 +90,9 @@ void ImageLayoutTransition2(VkImage Image,
     rc<CommandBuffer> Cmd,
     ImageState Src,
     ImageState Dst, 
-    VkImageAspectFlags Aspect)
+    VkImageAspectFlags Aspect,
+    u32 SrcFamily,
+    u32 DstFamily)
 {
     // Create an image barrier object
     VkImageMemoryBarrier2 imageMemoryBarrier = {
@@ -102,10 +103,8 @@ void ImageLayoutTransition2(VkImage Image,
         .dstAccessMask = Dst.AccessMask,
         .oldLayout = Src.Layout,
         .newLayout = Dst.Layout,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL,
-        .dstQueueFamilyIndex = Cmd->Pool->PoolQueue->Family,
-        // .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        // .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .srcQueueFamilyIndex = SrcFamily,
+        .dstQueueFamilyIndex = DstFamily,
         .image = Image,
         .subresourceRange = {
                .aspectMask = Aspect,
@@ -115,15 +114,8 @@ void ImageLayoutTransition2(VkImage Image,
         },
     };
 
-    VkDependencyInfo dependencyInfo = {
-        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
-        .dependencyFlags = VK_DEPENDENCY_DEVICE_GROUP_BIT,
-        .imageMemoryBarrierCount = 1,
-        .pImageMemoryBarriers = &imageMemoryBarrier,
-    };
-
-    // Put barrier inside setup command buffer
-    Cmd->PipelineBarrier2(&dependencyInfo);
+    // Recorded with the other pending barriers before the next command
+    Cmd->AddBarrier(imageMemoryBarrier);
     // Cmd->PipelineBarrier(Src.StageMask, Dst.StageMask, VK_DEPENDENCY_DEVICE_GROUP_BIT, 0, 0, 0, 0, 1, &imageMemoryBarrier);
 }
 
@@ -0,0 +1,156 @@
+// Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+
+#include "nosVulkan/CompletionDispatcher.h"
+#include "nosVulkan/Device.h"
+
+#undef CreateSemaphore
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace nos::vk
+{
+
+CompletionDispatcher::CompletionDispatcher(Device* Vk, Executor executor)
+    : DeviceChild(Vk), Exec(std::move(executor))
+{
+    VkSemaphoreTypeCreateInfo timelineInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = 0,
+    };
+
+    VkSemaphoreCreateInfo semaphoreInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &timelineInfo,
+    };
+
+    NOSVK_ASSERT(Vk->CreateSemaphore(&semaphoreInfo, 0, &WakeTimeline));
+    Thread = std::thread([this] { Run(); });
+}
+
+CompletionDispatcher::~CompletionDispatcher()
+{
+    Stop = true;
+    {
+        std::unique_lock lock(Mutex);
+        Wake();
+    }
+    Thread.join();
+
+    // Whatever is left still has to run, wait for the device to finish it
+    std::move(Incoming.begin(), Incoming.end(), std::back_inserter(Tracked));
+    for (auto& entry : Tracked)
+    {
+        VkSemaphoreWaitInfo waitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+            .semaphoreCount = 1,
+            .pSemaphores = &entry.Timeline,
+            .pValues = &entry.Value,
+        };
+        Vk->WaitSemaphores(&waitInfo, UINT64_MAX);
+        entry.Work->Run();
+    }
+    Vk->DestroySemaphore(WakeTimeline, 0);
+}
+
+void CompletionDispatcher::Track(rc<CommandBuffer> cmd)
+{
+    // Cleared buffers keep their completion, it is reused once the dispatcher let go of it
+    auto work = cmd->Dispatched;
+    if (!work || work.use_count() > 2)
+        work = cmd->Dispatched = MakeShared<CommandBuffer::Completion>();
+    work->Claimed = false;
+    work->Runner = std::thread::id();
+    work->Done = false;
+    std::swap(work->Callbacks, cmd->Callbacks);
+    std::swap(work->Retained, cmd->Retained);
+    std::swap(work->Secondaries, cmd->Secondaries);
+
+    std::unique_lock lock(Mutex);
+    Incoming.push_back(Entry{cmd->Pool->Timeline, cmd->SubmitValue, std::move(work)});
+    Wake();
+}
+
+void CompletionDispatcher::Wake()
+{
+    // Host signals must increase, callers hold Mutex
+    VkSemaphoreSignalInfo signalInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SIGNAL_INFO,
+        .semaphore = WakeTimeline,
+        .value = ++WakeValue,
+    };
+    NOSVK_ASSERT(Vk->SignalSemaphore(&signalInfo));
+}
+
+void CompletionDispatcher::Dispatch(rc<CommandBuffer::Completion> work)
+{
+    if (Exec)
+        Exec([work = std::move(work)] { work->Run(); });
+    else
+        work->Run();
+}
+
+void CompletionDispatcher::Run()
+{
+    std::vector<VkSemaphore> semaphores;
+    std::vector<u64> values;
+    std::unordered_map<VkSemaphore, u64> completed;
+    u64 wakeSeen = 0;
+
+    while (!Stop)
+    {
+        {
+            std::unique_lock lock(Mutex);
+            std::move(Incoming.begin(), Incoming.end(), std::back_inserter(Tracked));
+            Incoming.clear();
+        }
+
+        // One wait per timeline on the smallest value still pending on it
+        semaphores.assign(1, WakeTimeline);
+        values.assign(1, wakeSeen + 1);
+        for (auto& entry : Tracked)
+        {
+            auto it = std::find(semaphores.begin() + 1, semaphores.end(), entry.Timeline);
+            if (it == semaphores.end())
+            {
+                semaphores.push_back(entry.Timeline);
+                values.push_back(entry.Value);
+            }
+            else
+            {
+                auto& value = values[it - semaphores.begin()];
+                value = std::min(value, entry.Value);
+            }
+        }
+
+        VkSemaphoreWaitInfo waitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+            .flags = VK_SEMAPHORE_WAIT_ANY_BIT,
+            .semaphoreCount = (u32)semaphores.size(),
+            .pSemaphores = semaphores.data(),
+            .pValues = values.data(),
+        };
+        auto res = Vk->WaitSemaphores(&waitInfo, UINT64_MAX);
+        if (NOS_VULKAN_FAILED(res))
+        {
+            GLog.E("Completion thread failed to wait on submissions: %s", vk_result_string(res));
+            break;
+        }
+
+        NOSVK_ASSERT(Vk->GetSemaphoreCounterValue(WakeTimeline, &wakeSeen));
+
+        completed.clear();
+        for (size_t i = 1; i < semaphores.size(); ++i)
+            NOSVK_ASSERT(Vk->GetSemaphoreCounterValue(semaphores[i], &completed[semaphores[i]]));
+
+        auto done = std::stable_partition(Tracked.begin(), Tracked.end(), [&completed](Entry const& entry) {
+            return completed[entry.Timeline] < entry.Value;
+        });
+        for (auto it = done; it != Tracked.end(); ++it)
+            Dispatch(std::move(it->Work));
+        Tracked.erase(done, Tracked.end());
+    }
+}
+
+} // namespace nos::vk
@@ -8,7 +8,9 @@
 #include "nosVulkan/Common.h"
 #include "nosVulkan/Device.h"
 #include "nosVulkan/Command.h"
+#include "nosVulkan/CompletionDispatcher.h"
 #include "nosVulkan/QueryPool.h"
+#include "nosVulkan/Bindless.h"
 #include "nosVulkan/Platform.h"
 
 #include <iostream>
@@ -58,6 +60,12 @@ static std::vector<const char*> deviceExtensions = {
 	"VK_EXT_memory_budget",
     // "VK_NV_external_memory_rdma",
 };
+
+// Enabled when available, the code paths built on them check the matching Device members
+static std::vector<const char*> optionalDeviceExtensions = {
+    "VK_KHR_push_descriptor",
+};
+
 static constexpr char PIPELINE_CACHE_FILE_PREFIX[] = "PipelineCache_";
 
 namespace nos::vk
@@ -223,6 +231,8 @@ void Device::InitializeVMA()
 	};
 
     VmaAllocatorCreateInfo createInfo = {
+        // Descriptor buffers and the buffers written into them are addressed by device address
+        .flags = DescriptorBuffers ? VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT : (VmaAllocatorCreateFlags)0,
         .physicalDevice = PhysicalDevice,
         .device = handle,
 		.pDeviceMemoryCallbacks = &deviceMemoryCallbacks,
@@ -264,6 +274,80 @@ rc<QueryPool> Device::GetQPool()
 	return res.second;
 }
 
+rc<Queue> Device::GetQueue(QueueType type) const
+{
+	switch (type)
+	{
+	case QueueType::Compute: return ComputeQueue;
+	case QueueType::Transfer: return TransferQueue;
+	default: return MainQueue;
+	}
+}
+
+void Device::StartCompletionThread(std::function<void(std::function<void()>)> executor)
+{
+	std::unique_lock lock(CompletionsMutex);
+	if (!Completions)
+		Completions = CompletionDispatcher::New(this, std::move(executor));
+}
+
+void Device::StopCompletionThread()
+{
+	rc<CompletionDispatcher> completions;
+	{
+		std::unique_lock lock(CompletionsMutex);
+		completions = std::move(Completions);
+	}
+	// Runs everything still tracked before returning, unless a submission still holds it
+}
+
+rc<CompletionDispatcher> Device::GetCompletions()
+{
+	std::unique_lock lock(CompletionsMutex);
+	return Completions;
+}
+
+rc<StagingRing> Device::GetStagingRing()
+{
+	std::unique_lock lock(StagingMutex);
+	if (!Staging)
+		Staging = StagingRing::New(this, StagingRingCapacity);
+	return Staging;
+}
+
+rc<UniformArena> Device::GetUniformArena()
+{
+	std::unique_lock lock(UniformsMutex);
+	if (!Uniforms)
+		Uniforms = UniformArena::New(this);
+	return Uniforms;
+}
+
+rc<StagingRing> Device::GetDescriptorRing()
+{
+	NOSVK_ASSERT(DescriptorBuffers);
+	std::unique_lock lock(DescriptorRingMutex);
+	if (!DescriptorRing)
+	{
+		VkDeviceSize maxCapacity = std::min(DescriptorBufferProps.maxResourceDescriptorBufferRange, DescriptorBufferProps.maxSamplerDescriptorBufferRange);
+		DescriptorRing = StagingRing::New(this, std::min(DescriptorRingCapacity, maxCapacity),
+			VK_BUFFER_USAGE_RESOURCE_DESCRIPTOR_BUFFER_BIT_EXT | VK_BUFFER_USAGE_SAMPLER_DESCRIPTOR_BUFFER_BIT_EXT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+			MemoryProperties{.Mapped = true});
+		// Only one descriptor buffer can be bound at a time, so the ring grows instead of falling back
+		DescriptorRing->MaxCapacity = maxCapacity;
+	}
+	return DescriptorRing;
+}
+
+rc<BindlessHeap> Device::GetBindlessHeap()
+{
+	NOSVK_ASSERT(BindlessDescriptors);
+	std::unique_lock lock(BindlessMutex);
+	if (!Bindless)
+		Bindless = BindlessHeap::New(this);
+	return Bindless;
+}
+
 Device::MemoryUsage Device::GetCurrentMemoryUsage() const
 {
 	MemoryUsage res{};
@@ -280,10 +364,109 @@ Device::MemoryUsage Device::GetCurrentMemoryUsage() const
 	return res;
 }
 
-Device::Device(VkInstance Instance, VkPhysicalDevice PhysicalDevice, const nos::vk::Context* context)
+void Device::SetMemoryBudget(bool enabled, float highWaterMark, float lowWaterMark)
+{
+	std::unique_lock lock(MemoryBudget.Mutex);
+	MemoryBudget.HighWaterMark = highWaterMark;
+	MemoryBudget.LowWaterMark = std::min(lowWaterMark, highWaterMark);
+	MemoryBudget.Enabled = enabled;
+}
+
+u64 Device::AddMemoryPressureCallback(std::function<void(MemoryUsage const&)> callback)
+{
+	std::unique_lock lock(MemoryBudget.CallbacksMutex);
+	auto id = ++MemoryBudget.NextCallbackId;
+	MemoryBudget.PressureCallbacks[id] = std::move(callback);
+	return id;
+}
+
+void Device::RemoveMemoryPressureCallback(u64 id)
+{
+	std::unique_lock lock(MemoryBudget.CallbacksMutex);
+	MemoryBudget.PressureCallbacks.erase(id);
+}
+
+// Bytes the resource takes from the heaps GetCurrentMemoryUsage counts, evicting anything else does not bring it down
+template <class T>
+static u64 GetDeviceLocalSize(T const& res)
+{
+	if (!res.AllocationInfo || res.AllocationInfo->Imported)
+		return 0;
+	auto& props = res.Vk->MemoryProps.memoryProperties;
+	u32 heap = props.memoryTypes[res.AllocationInfo->GetMemoryTypeIndex()].heapIndex;
+	return (props.memoryHeaps[heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) ? res.Size : 0;
+}
+
+void Device::EnforceMemoryBudget()
+{
+	if (!MemoryBudget.Enabled)
+		return;
+	// Another thread is already evicting
+	std::unique_lock lock(MemoryBudget.Mutex, std::try_to_lock);
+	if (!lock)
+		return;
+
+	auto usage = GetCurrentMemoryUsage();
+	if (!usage.Budget || usage.Usage <= usage.Budget * MemoryBudget.HighWaterMark)
+		return;
+
+	size_t target = size_t(usage.Budget * MemoryBudget.LowWaterMark);
+	size_t current = usage.Usage;
+	for (u32 evictions = 1; current > target; ++evictions)
+	{
+		auto image = ResourcePools.Image->GetOldestReleaseTime(&GetDeviceLocalSize<vk::Image>);
+		auto buffer = ResourcePools.Buffer->GetOldestReleaseTime(&GetDeviceLocalSize<vk::Buffer>);
+		if (!image && !buffer)
+			break;
+		// Both pools only consider resources in device local heaps, host memory does not count towards the budget
+		u64 freed = (image && (!buffer || *image <= *buffer)) ? ResourcePools.Image->EvictOldest(&GetDeviceLocalSize<vk::Image>)
+															  : ResourcePools.Buffer->EvictOldest(&GetDeviceLocalSize<vk::Buffer>);
+		current -= std::min<size_t>(current, freed);
+		// The estimate misses allocator blocks that are freed or kept, catch up with the real usage now and then
+		if (MemoryBudget.ResyncInterval && 0 == evictions % MemoryBudget.ResyncInterval)
+			current = std::min(current, GetCurrentMemoryUsage().Usage);
+	}
+
+	// Sizes of the resources are only an estimate of what the allocator gives back
+	usage = GetCurrentMemoryUsage();
+	auto now = std::chrono::steady_clock::now();
+	if (usage.Usage <= target || now - MemoryBudget.LastPressure < MemoryBudget.PressureInterval)
+		return;
+	MemoryBudget.LastPressure = now;
+
+	GLog.W("Device memory usage %zu is over %zu of budget %zu after evicting pooled resources", usage.Usage, target, usage.Budget);
+	std::vector<std::function<void(MemoryUsage const&)>> callbacks;
+	{
+		std::unique_lock cbLock(MemoryBudget.CallbacksMutex);
+		for (auto& [_, cb] : MemoryBudget.PressureCallbacks)
+			callbacks.push_back(cb);
+	}
+	for (auto& cb : callbacks)
+		cb(usage);
+}
+
+namespace detail
+{
+void CheckMemoryBudget(vk::Device* device)
+{
+	auto& budget = device->MemoryBudget;
+	if (!budget.Enabled)
+		return;
+	// Querying the budget is a driver call, one caller per interval does it
+	auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+	auto next = budget.NextCheck.load(std::memory_order_relaxed);
+	auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(budget.CheckInterval).count();
+	if (now < next || !budget.NextCheck.compare_exchange_strong(next, now + interval, std::memory_order_relaxed))
+		return;
+	device->EnforceMemoryBudget();
+}
+} // namespace detail
+
+Device::Device(VkInstance Instance, VkPhysicalDevice PhysicalDevice, const nos::vk::Context* context, bool descriptorBuffers)
     : Instance(Instance), PhysicalDevice(PhysicalDevice), Features(PhysicalDevice), ResourcePools(this), Context(context)
 {
 	vkGetPhysicalDeviceMemoryProperties2(PhysicalDevice, &MemoryProps);
+	vkGetPhysicalDeviceProperties(PhysicalDevice, &Props);
 
     u32 count;
 
@@ -322,6 +505,45 @@ Device::Device(VkInstance Instance, VkPhysicalDevice PhysicalDevice, const nos::
         }
         else deviceExtensionsToAsk.push_back(ext);
     }
+
+    for (auto ext : optionalDeviceExtensions)
+    {
+        if (std::find_if(extensionProps.begin(), extensionProps.end(), [=](auto& prop) {
+                return 0 == strcmp(ext, prop.extensionName);
+            }) != extensionProps.end())
+            deviceExtensionsToAsk.push_back(ext);
+    }
+
+    if (descriptorBuffers)
+    {
+        VkPhysicalDeviceDescriptorBufferFeaturesEXT descriptorBufferFeatures = {.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_BUFFER_FEATURES_EXT};
+        VkPhysicalDeviceFeatures2 features2 = {.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, .pNext = &descriptorBufferFeatures};
+        vkGetPhysicalDeviceFeatures2(PhysicalDevice, &features2);
+        DescriptorBuffers = descriptorBufferFeatures.descriptorBuffer && Features.bufferDeviceAddress &&
+                            std::find_if(extensionProps.begin(), extensionProps.end(), [](auto& prop) {
+                                return 0 == strcmp(VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME, prop.extensionName);
+                            }) != extensionProps.end();
+        if (DescriptorBuffers)
+        {
+            deviceExtensionsToAsk.push_back(VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME);
+            VkPhysicalDeviceProperties2 props2 = {.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, .pNext = &DescriptorBufferProps};
+            vkGetPhysicalDeviceProperties2(PhysicalDevice, &props2);
+            DescriptorBufferProps.pNext = nullptr;
+        }
+        else
+            GLog.W("%s does not support descriptor buffers, using descriptor pools", Props.deviceName);
+    }
+
+    PushDescriptors = !DescriptorBuffers && std::find_if(deviceExtensionsToAsk.begin(), deviceExtensionsToAsk.end(), [](auto ext) {
+        return 0 == strcmp(ext, VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+    }) != deviceExtensionsToAsk.end();
+    if (PushDescriptors)
+    {
+        VkPhysicalDevicePushDescriptorPropertiesKHR pushProps = {.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PUSH_DESCRIPTOR_PROPERTIES_KHR};
+        VkPhysicalDeviceProperties2 props2 = {.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, .pNext = &pushProps};
+        vkGetPhysicalDeviceProperties2(PhysicalDevice, &props2);
+        MaxPushDescriptors = pushProps.maxPushDescriptors;
+    }
     
     vkGetPhysicalDeviceQueueFamilyProperties(PhysicalDevice, &count, 0);
     std::vector<VkQueueFamilyProperties> props(count);
@@ -340,14 +562,32 @@ Device::Device(VkInstance Instance, VkPhysicalDevice PhysicalDevice, const nos::
         family++;
     }
 
+    // Dedicated families let compute and transfer work run alongside rendering
+    u32 computeFamily = ~0u;
+    u32 transferFamily = ~0u;
+    for (u32 i = 0; i < props.size(); ++i)
+    {
+        auto flags = props[i].queueFlags;
+        if (~0u == computeFamily && (flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT))
+            computeFamily = i;
+        if (~0u == transferFamily && (flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
+            transferFamily = i;
+    }
+
     float prio = 1.f;
 
-    VkDeviceQueueCreateInfo qinfo = {
-        .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-        .queueFamilyIndex = family,
-        .queueCount       = 1,
-        .pQueuePriorities = &prio,
-    };
+    std::vector<VkDeviceQueueCreateInfo> qinfos;
+    for (u32 f : {family, computeFamily, transferFamily})
+    {
+        if (~0u == f)
+            continue;
+        qinfos.push_back(VkDeviceQueueCreateInfo{
+            .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .queueFamilyIndex = f,
+            .queueCount       = 1,
+            .pQueuePriorities = &prio,
+        });
+    }
 
     FeatureSet set;
     
@@ -367,22 +607,48 @@ Device::Device(VkInstance Instance, VkPhysicalDevice PhysicalDevice, const nos::
     set.features.samplerAnisotropy = VK_TRUE;
 
     set.runtimeDescriptorArray = VK_TRUE;
+    set.descriptorBindingPartiallyBound = VK_TRUE;
+    set.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+    set.descriptorBindingStorageImageUpdateAfterBind = VK_TRUE;
+    set.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+    set.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+    set.shaderStorageImageArrayNonUniformIndexing = VK_TRUE;
+    set.shaderStorageBufferArrayNonUniformIndexing = VK_TRUE;
+
+    set.bufferDeviceAddress = DescriptorBuffers;
 
     auto available = Features & set;
+    // The heap is an update-after-bind descriptor set, which cannot be bound together with descriptor buffers
+    BindlessDescriptors = !DescriptorBuffers &&
+                          available.runtimeDescriptorArray &&
+                          available.descriptorBindingPartiallyBound &&
+                          available.descriptorBindingSampledImageUpdateAfterBind &&
+                          available.descriptorBindingStorageImageUpdateAfterBind &&
+                          available.descriptorBindingStorageBufferUpdateAfterBind;
     VkDeviceCreateInfo info = {
         .sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
         .pNext                   = available.pnext(),
-        .queueCreateInfoCount    = 1,
-        .pQueueCreateInfos       = &qinfo,
+        .queueCreateInfoCount    = (u32)qinfos.size(),
+        .pQueueCreateInfos       = qinfos.data(),
         .enabledLayerCount       = (u32)layers.size(),
         .ppEnabledLayerNames     = layers.data(),
         .enabledExtensionCount   = (u32)deviceExtensionsToAsk.size(),
         .ppEnabledExtensionNames = deviceExtensionsToAsk.data(),
     };
 
+    VkPhysicalDeviceDescriptorBufferFeaturesEXT descriptorBufferFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_BUFFER_FEATURES_EXT,
+        .pNext = available.pnext(),
+        .descriptorBuffer = VK_TRUE,
+    };
+    if (DescriptorBuffers)
+        info.pNext = &descriptorBufferFeatures;
+
     NOSVK_ASSERT(vkCreateDevice(PhysicalDevice, &info, 0, &handle));
     vkl_load_device_functions(handle, this);
     MainQueue = Queue::New(this, family, 0);
+    ComputeQueue = ~0u != computeFamily ? Queue::New(this, computeFamily, 0) : MainQueue;
+    TransferQueue = ~0u != transferFamily ? Queue::New(this, transferFamily, 0) : MainQueue;
 	InitializeVMA();
     GetSampler(VK_FILTER_NEAREST);
     GetSampler(VK_FILTER_LINEAR);
@@ -407,9 +673,12 @@ void Context::OrderDevices()
 
 Device::~Device()
 {
+    for (auto& queue : {MainQueue, ComputeQueue, TransferQueue})
+        queue->StopSubmitThread();
+    StopCompletionThread();
+
     DestroyDevicePipelineCache(this);
 
-	ResourcePools.Clear();
     {
         std::lock_guard lock(Lock);
         Devices.erase(this);
@@ -430,6 +699,14 @@ Device::~Device()
 		std::unique_lock ulock(ImmPoolsMutex);
 		ImmPools.clear();
 	}
+	// After the command pools, their callbacks hand deferred resources back to these
+	ResourcePools.Clear();
+	SharedDescriptorPools.clear();
+	// Pooled views and buffers hand their slots back to the heap when they are destroyed above
+	Bindless = nullptr;
+	Staging = nullptr;
+	Uniforms = nullptr;
+	DescriptorRing = nullptr;
 	vmaDestroyAllocator(Allocator);
     DestroyDevice(0);
 }
@@ -566,13 +843,13 @@ Context::~Context()
     vkDestroyInstance(Instance, 0);
 }
 
-rc<Device> Context::CreateDevice(u64 luid) const
+rc<Device> Context::CreateDevice(u64 luid, bool descriptorBuffers) const
 {
     for (auto dev : Devices)
     {
         if (dev->GetLuid() == luid)
         {
-            return Device::New(Instance, dev->PhysicalDevice, this);
+            return Device::New(Instance, dev->PhysicalDevice, this, descriptorBuffers);
         }
     }
     return 0;
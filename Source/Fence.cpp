@@ -0,0 +1,44 @@
+// Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+
+#include "nosVulkan/Fence.h"
+#include "nosVulkan/Device.h"
+
+namespace nos::vk
+{
+
+Fence::Fence(Device* Vk, VkFenceCreateFlags flags)
+	: DeviceChild(Vk)
+{
+	VkFenceCreateInfo fenceInfo = {
+		.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+		.flags = flags,
+	};
+	NOSVK_ASSERT(Vk->CreateFence(&fenceInfo, 0, &Handle));
+}
+
+VkResult Fence::Wait(uint64_t timeoutNs)
+{
+	return Vk->WaitForFences(1, &Handle, VK_TRUE, timeoutNs);
+}
+
+bool Fence::IsSignaled() const
+{
+	return Vk->GetFenceStatus(Handle) == VK_SUCCESS;
+}
+
+void Fence::Reset()
+{
+	NOSVK_ASSERT(Vk->ResetFences(1, &Handle));
+}
+
+Fence::operator VkFence() const
+{
+	return Handle;
+}
+
+Fence::~Fence()
+{
+	Vk->DestroyFence(Handle, 0);
+}
+
+} // namespace nos::vk
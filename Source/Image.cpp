@@ -5,6 +5,7 @@
 #include <nosVulkan/Device.h>
 #include <nosVulkan/Command.h>
 #include <nosVulkan/Buffer.h>
+#include <nosVulkan/Bindless.h>
 
 namespace nos::vk
 {
@@ -23,6 +24,9 @@ Image::~Image()
 
 ImageView::~ImageView()
 {
+    for (u32 i = 0; i < 2; ++i)
+        if (~0u != BindlessIndex[i])
+            Vk->Bindless->Unregister(i, BindlessIndex[i]);
     Vk->DestroyImageView(Handle, 0);
 }
 
@@ -68,6 +72,7 @@ Image::Image(Device* Vk, ImageCreateInfo const& createInfo, VkResult* re)
 	AllocationInfo = vk::Allocation{};
 	if (createInfo.Imported)
     {
+		ExternallyOwned = true;
 		State.Layout = VK_IMAGE_LAYOUT_PREINITIALIZED;
 	    assert(IsImportable(Vk->PhysicalDevice, Format, Usage, VkExternalMemoryHandleTypeFlagBits(createInfo.Imported->HandleType)));
     }
@@ -154,7 +159,8 @@ Image::Image(Device* vk, VkImage img, VkExtent2D extent, VkFormat format, VkImag
 		  .StageMask = VK_PIPELINE_STAGE_NONE,
 		  .AccessMask = 0,
 		  .Layout = VK_IMAGE_LAYOUT_UNDEFINED,
-	  }
+	  },
+	  ExternallyOwned(true)
 {
     Handle = img;
 	VkMemoryRequirements memReq = {};
@@ -168,18 +174,73 @@ void Image::Transition(
 {
     // Dst.AccessMask = 0;
     // Dst.StageMask  = 0;
-    if (!Vk->Features.synchronization2)
+    auto record = [this, &Cmd](ImageState const& src, ImageState const& dst, std::pair<u32, u32> families) {
+        if (!Vk->Features.synchronization2)
+            ImageLayoutTransition(Handle, Cmd, src, dst, GetAspect(), families.first, families.second);
+        else
+            ImageLayoutTransition2(Handle, Cmd, src, dst, GetAspect(), families.first, families.second);
+    };
+
+    u32 family = Cmd->Pool->PoolQueue->Family;
+    if (!ExternallyOwned && !IsOwnedBy(family))
     {
-        ImageLayoutTransition(Handle, Cmd, State, Dst, GetAspect());
+        auto families = AcquireOwnership(family, VK_IMAGE_LAYOUT_UNDEFINED == State.Layout);
+        if (families.first != families.second)
+        {
+            // The acquire must repeat the layouts of the release barrier, a layout change follows separately
+            ImageState acquired = {.StageMask = Dst.StageMask, .AccessMask = Dst.AccessMask, .Layout = State.Layout};
+            record(State, acquired, families);
+            Cmd->FlushBarriers();
+            LastWrite = GetWriteScope(State.StageMask, State.AccessMask, acquired.StageMask, acquired.AccessMask);
+            State = acquired;
+            if (State.Layout == Dst.Layout)
+            {
+                Cmd->AddDependency(shared_from_this());
+                return;
+            }
+        }
     }
-    else 
+
+    if (Vk->Features.synchronization2 && !ExternallyOwned &&
+        !IsBarrierNeeded(State.AccessMask, Dst.AccessMask, State.Layout, Dst.Layout))
     {
-        ImageLayoutTransition2(Handle, Cmd, State, Dst, GetAspect());
+        // Readers in stages the last barrier did not cover wait on the last write themselves
+        if (LastWrite.StageMask && !IsReadCovered(State.StageMask, State.AccessMask, Dst.StageMask, Dst.AccessMask))
+            record(ImageState{.StageMask = LastWrite.StageMask, .AccessMask = LastWrite.AccessMask, .Layout = State.Layout}, Dst,
+                   {VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED});
+        // Later writers still have to wait for every reader
+        State.StageMask |= Dst.StageMask;
+        State.AccessMask |= Dst.AccessMask;
+        Cmd->AddDependency(shared_from_this());
+        return;
     }
+
+    std::pair<u32, u32> families = {VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED};
+    if (ExternallyOwned)
+        families = {VK_QUEUE_FAMILY_EXTERNAL, family};
+    QueueFamily = family;
+    record(State, Dst, families);
+    LastWrite = GetWriteScope(State.StageMask, State.AccessMask, Dst.StageMask, Dst.AccessMask);
     State = Dst;
     Cmd->AddDependency(shared_from_this());
 }
 
+void Image::ReleaseOwnership(rc<CommandBuffer> Cmd, u32 DstFamily)
+{
+    u32 family = Cmd->Pool->PoolQueue->Family;
+    if (ExternallyOwned || DstFamily == family || VK_QUEUE_FAMILY_IGNORED == QueueFamily)
+        return;
+    assert(family == QueueFamily);
+    ImageState dst = {.StageMask = VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT, .AccessMask = 0, .Layout = State.Layout};
+    if (!Vk->Features.synchronization2)
+        ImageLayoutTransition(Handle, Cmd, State, dst, GetAspect(), family, DstFamily);
+    else
+        ImageLayoutTransition2(Handle, Cmd, State, dst, GetAspect(), family, DstFamily);
+    State = dst;
+    OwnershipReleased = true;
+    Cmd->AddDependency(shared_from_this());
+}
+
 void Image::Clear(rc<CommandBuffer> Cmd, VkClearColorValue value)
 {
     assert(Usage & VK_IMAGE_USAGE_TRANSFER_DST_BIT);
@@ -196,7 +257,7 @@ void Image::Clear(rc<CommandBuffer> Cmd, VkClearColorValue value)
     Cmd->ClearColorImage(Handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &value, 1, &range);
 }
 
-void Image::Upload(rc<CommandBuffer> Cmd, rc<Buffer> Src, u32 bufferRowLength, u32 bufferImageHeight)
+void Image::Upload(rc<CommandBuffer> Cmd, rc<Buffer> Src, u32 bufferRowLength, u32 bufferImageHeight, VkDeviceSize bufferOffset)
 {
     assert(Usage & VK_IMAGE_USAGE_TRANSFER_DST_BIT);
     assert(Src->Usage & VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
@@ -211,6 +272,7 @@ void Image::Upload(rc<CommandBuffer> Cmd, rc<Buffer> Src, u32 bufferRowLength, u
                     });
 
     VkBufferImageCopy region = {
+        .bufferOffset = bufferOffset,
         .bufferRowLength = bufferRowLength,
         .bufferImageHeight = bufferImageHeight,
         .imageSubresource = {
@@ -228,6 +290,15 @@ void Image::Upload(rc<CommandBuffer> Cmd, rc<Buffer> Src, u32 bufferRowLength, u
 
 }
 
+void Image::Upload(rc<CommandBuffer> Cmd, const void* data, VkDeviceSize size, u32 bufferRowLength, u32 bufferImageHeight)
+{
+    auto ring = Vk->GetStagingRing();
+    auto staging = ring->Allocate(size);
+    memcpy(staging.Data(), data, size);
+    Upload(Cmd, staging.Buffer, bufferRowLength, bufferImageHeight, staging.Offset);
+    ring->Release(Cmd, staging);
+}
+
 rc<Image> Image::Copy(rc<CommandBuffer> Cmd)
 {
     assert(Usage & VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
@@ -280,7 +351,19 @@ rc<Buffer> Image::Download(rc<CommandBuffer> Cmd)
     return StagingBuffer;
 }
 
-void Image::Download(rc<CommandBuffer> Cmd, rc<Buffer> Buffer)
+void Image::Download(rc<CommandBuffer> Cmd, std::function<void(const u8* data, u64 size)> OnDownloaded)
+{
+    assert(Usage & VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+
+    auto ring = Vk->GetStagingRing();
+    auto staging = ring->Allocate(Size);
+    Download(Cmd, staging.Buffer, staging.Offset);
+    // Runs before the Retire callback added by Release, which is the only one that frees a host read range
+    Cmd->Callbacks.push_back([staging, OnDownloaded = std::move(OnDownloaded)]() { OnDownloaded(staging.Data(), staging.Size); });
+    ring->Release(Cmd, staging, true);
+}
+
+void Image::Download(rc<CommandBuffer> Cmd, rc<Buffer> Buffer, VkDeviceSize bufferOffset)
 {
     // assert(Buffer->Allocation.LocalSize() >= Allocation.LocalSize());
     Transition(Cmd, ImageState{
@@ -290,6 +373,7 @@ void Image::Download(rc<CommandBuffer> Cmd, rc<Buffer> Buffer)
                     });
 
     VkBufferImageCopy region = {
+        .bufferOffset = bufferOffset,
         .imageSubresource = {
             .aspectMask = GetAspect(),
             .layerCount = 1,
@@ -471,6 +555,26 @@ DescriptorResourceInfo ImageView::GetDescriptorInfo(VkFilter filter) const
         }};
 }
 
+void Image::DiscardContents()
+{
+    // Written outside this device, every transition acquires it from VK_QUEUE_FAMILY_EXTERNAL anyway
+    if (ExternallyOwned)
+        return;
+    ResetOwnership();
+    State = {
+        .StageMask = VK_PIPELINE_STAGE_NONE,
+        .AccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT,
+        .Layout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+    LastWrite = {};
+}
+
+u32 Image::GetBindlessIndex(rc<CommandBuffer> Cmd, VkDescriptorType type)
+{
+    Cmd->AddDependency(shared_from_this());
+    return Vk->GetBindlessHeap()->Register(GetView().get(), type);
+}
+
 rc<ImageView> Image::GetView(VkFormat Format, VkImageUsageFlags Usage)
 { 
     Format = (Format ? Format : this->Format);
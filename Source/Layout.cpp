@@ -8,6 +8,7 @@
 #include "nosVulkan/Layout.h"
 #include "nosVulkan/Command.h"
 #include "nosVulkan/Image.h"
+#include "nosVulkan/Bindless.h"
 
 namespace nos::vk
 {
@@ -17,8 +18,9 @@ NamedDSLBinding const& DescriptorLayout::operator[](u32 binding) const
     return Bindings.at(binding);
 }
 
-DescriptorLayout::DescriptorLayout(Device* Vk, std::map<u32, NamedDSLBinding> NamedBindings)
-    : DeviceChild(Vk), Bindings(std::move(NamedBindings))
+DescriptorLayout::DescriptorLayout(Device* Vk, std::map<u32, NamedDSLBinding> NamedBindings, VkDescriptorSetLayoutCreateFlags Flags, VkDescriptorBindingFlags BindingFlags)
+    : DeviceChild(Vk), Bindings(std::move(NamedBindings)),
+      Flags(Vk->DescriptorBuffers ? Flags | VK_DESCRIPTOR_SET_LAYOUT_CREATE_DESCRIPTOR_BUFFER_BIT_EXT : Flags)
 {
     std::vector<VkDescriptorSetLayoutBinding> bindings;
     bindings.reserve(Bindings.size());
@@ -35,13 +37,29 @@ DescriptorLayout::DescriptorLayout(Device* Vk, std::map<u32, NamedDSLBinding> Na
             });
     }
 
+    std::vector<VkDescriptorBindingFlags> bindingFlags(bindings.size(), BindingFlags);
+    VkDescriptorSetLayoutBindingFlagsCreateInfo flagsInfo = {
+        .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+        .bindingCount  = (u32)bindingFlags.size(),
+        .pBindingFlags = bindingFlags.data(),
+    };
+
     VkDescriptorSetLayoutCreateInfo info = {
         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .pNext = BindingFlags ? &flagsInfo : nullptr,
+        .flags = this->Flags,
         .bindingCount = (u32)bindings.size(),
         .pBindings = bindings.data(),
     };
 
     NOSVK_ASSERT(Vk->CreateDescriptorSetLayout(&info, 0, &Handle));
+
+    if (Vk->DescriptorBuffers)
+    {
+        Vk->GetDescriptorSetLayoutSizeEXT(Handle, &DescriptorBufferSize);
+        for (auto& [i, _] : Bindings)
+            Vk->GetDescriptorSetLayoutBindingOffsetEXT(Handle, i, &DescriptorBufferOffsets[i]);
+    }
 }
 
 DescriptorLayout::~DescriptorLayout()
@@ -49,54 +67,131 @@ DescriptorLayout::~DescriptorLayout()
     Vk->DestroyDescriptorSetLayout(Handle, 0);
 }
 
-void DescriptorSet::Update(std::set<Binding> const& res)
+static void WriteDescriptor(DescriptorLayout& layout, VkDescriptorSet dst, Binding const& res, DescriptorResourceInfo* info, VkWriteDescriptorSet* write)
 {
-    // BindStates.clear();
- 
-    std::map<u32, std::vector<DescriptorResourceInfo>> infos;
-    std::vector<VkWriteDescriptorSet> writes(Layout->Bindings.size());
+    auto dc = layout.Bindings[res.Idx].DescriptorCount;
+    auto type = layout.Bindings[res.Idx].DescriptorType;
+
+    *info = res.GetDescriptorInfo(type);
+    
+    if (1 == dc || 0 == res.ArrayIdx)
+    {
+        *write = {
+               .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+               .dstSet = dst,
+               .dstBinding = res.Idx,
+               .descriptorCount = dc,
+               .descriptorType = type,
+               .pImageInfo = (std::get_if<rc<Image>>(&res.Resource) ? &info->Image : 0),
+               .pBufferInfo = (std::get_if<rc<Buffer>>(&res.Resource) ? &info->Buffer : 0),
+        };
+
+        for (u32 i = 1; i < dc; ++i)
+            info[i] = *info;
+    }
+}
+
+// One write per binding, infos keeps the descriptor infos the writes point to
+static u32 BuildWrites(DescriptorLayout& layout, VkDescriptorSet dst, std::set<Binding> const& res,
+                       std::map<u32, std::vector<DescriptorResourceInfo>>& infos, std::vector<VkWriteDescriptorSet>& writes)
+{
+    writes.resize(layout.Bindings.size());
     auto write = writes.data();
 
     for (auto it = res.begin(); it != res.end();)
     {
         auto& cur = infos[it->Idx];
-        cur.resize(Layout->Bindings[it->Idx].DescriptorCount);
+        cur.resize(layout.Bindings[it->Idx].DescriptorCount);
         auto info = cur.data();
         auto next = it;
         do
         {
-            Write(*next, info++, write);
+            WriteDescriptor(layout, dst, *next, info++, write);
             next = std::next(next);
         }
         while(next != res.end() && next->Idx == it->Idx);
         it = next;
         ++write;
     }
+    return u32(write - writes.data());
+}
 
-    Layout->Vk->UpdateDescriptorSets(write - writes.data(), writes.data(), 0, 0);
+static size_t GetDescriptorSize(VkPhysicalDeviceDescriptorBufferPropertiesEXT const& props, VkDescriptorType type)
+{
+    switch (type)
+    {
+    case VK_DESCRIPTOR_TYPE_SAMPLER: return props.samplerDescriptorSize;
+    case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER: return props.combinedImageSamplerDescriptorSize;
+    case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE: return props.sampledImageDescriptorSize;
+    case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE: return props.storageImageDescriptorSize;
+    case VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT: return props.inputAttachmentDescriptorSize;
+    case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER: return props.uniformBufferDescriptorSize;
+    case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER: return props.storageBufferDescriptorSize;
+    default: return 0;
+    }
 }
 
-void DescriptorSet::Write(Binding const& res, DescriptorResourceInfo* info, VkWriteDescriptorSet* write)
+// Writes the descriptor for res into the set's descriptor buffer data
+static void WriteDescriptorData(DescriptorLayout& layout, u8* dst, Binding const& res)
 {
-    auto dc = Layout->Bindings[res.Idx].DescriptorCount;
+    auto Vk = layout.GetDevice();
+    auto type = layout.Bindings[res.Idx].DescriptorType;
+    size_t size = GetDescriptorSize(Vk->DescriptorBufferProps, type);
+    if (!size)
+    {
+        GLog.E("Descriptor type %s is not supported with descriptor buffers", descriptor_type_to_string(type));
+        return;
+    }
 
-    *info = res.GetDescriptorInfo(GetType(res.Idx));
-    
-    if (1 == dc || 0 == res.ArrayIdx)
+    auto info = res.GetDescriptorInfo(type);
+    // Unbound images would need the nullDescriptor feature, descriptors that are never written are never accessed either
+    if (VK_IMAGE_LAYOUT_UNDEFINED != Binding::MapTypeToLayout(type) && !info.Image.imageView)
+        return;
+    VkDescriptorAddressInfoEXT address = {.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_ADDRESS_INFO_EXT};
+    VkDescriptorGetInfoEXT get = {.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_GET_INFO_EXT, .type = type};
+    switch (type)
     {
-        *write = {
-               .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-               .dstSet = Handle,
-               .dstBinding = res.Idx,
-               .descriptorCount = dc,
-               .descriptorType = GetType(res.Idx),
-               .pImageInfo = (std::get_if<rc<Image>>(&res.Resource) ? &info->Image : 0),
-               .pBufferInfo = (std::get_if<rc<Buffer>>(&res.Resource) ? &info->Buffer : 0),
-        };
+    case VK_DESCRIPTOR_TYPE_SAMPLER: get.data.pSampler = &info.Image.sampler; break;
+    case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER: get.data.pCombinedImageSampler = &info.Image; break;
+    case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE: get.data.pSampledImage = &info.Image; break;
+    case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE: get.data.pStorageImage = &info.Image; break;
+    case VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT: get.data.pInputAttachmentImage = &info.Image; break;
+    default:
+    {
+        auto buf = std::get_if<rc<Buffer>>(&res.Resource);
+        if (!buf || !*buf)
+            return;
+        address.address = (*buf)->GetAddress() + info.Buffer.offset;
+        address.range = VK_WHOLE_SIZE == info.Buffer.range ? (*buf)->Size - info.Buffer.offset : info.Buffer.range;
+        if (VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER == type)
+            get.data.pUniformBuffer = &address;
+        else
+            get.data.pStorageBuffer = &address;
+    }
+    }
+    Vk->GetDescriptorEXT(&get, size, dst + layout.DescriptorBufferOffsets[res.Idx] + res.ArrayIdx * size);
+}
 
-        for (u32 i = 1; i < dc; ++i)
-            info[i] = *info;
+void DescriptorSet::Update(std::set<Binding> const& res)
+{
+    // BindStates.clear();
+
+    if (!Pool)
+    {
+        for (auto& binding : res)
+            WriteDescriptorData(*Layout, DescriptorData.data(), binding);
+        return;
     }
+ 
+    std::map<u32, std::vector<DescriptorResourceInfo>> infos;
+    std::vector<VkWriteDescriptorSet> writes;
+    u32 count = BuildWrites(*Layout, Handle, res, infos, writes);
+    Layout->Vk->UpdateDescriptorSets(count, writes.data(), 0, 0);
+}
+
+void DescriptorSet::Write(Binding const& res, DescriptorResourceInfo* info, VkWriteDescriptorSet* write)
+{
+    WriteDescriptor(*Layout, Handle, res, info, write);
 
     if (rc<Image> const* ppImg = std::get_if<rc<Image>>(&res.Resource); ppImg && *ppImg)
     {
@@ -109,38 +204,48 @@ void DescriptorSet::Write(Binding const& res, DescriptorResourceInfo* info, VkWr
 
 }
 
-void DescriptorSet::Bind(rc<CommandBuffer> Cmd, VkPipelineBindPoint BindPoint)
+void DescriptorSet::Bind(rc<CommandBuffer> Cmd, VkPipelineBindPoint BindPoint, std::vector<u32> const& DynamicOffsets)
 {
+    if (!Pool)
+        return Owner->BindDescriptorBuffers(Cmd, BindPoint, {shared_from_this()});
     Cmd->AddDependency(shared_from_this());
-    Cmd->BindDescriptorSets(BindPoint, Pool->Layout->Handle, Index, 1, &Handle, 0, 0);
+    Cmd->BindDescriptorSets(BindPoint, Owner->Handle, Index, 1, &Handle, (u32)DynamicOffsets.size(), DynamicOffsets.data());
 }
 
-DescriptorSet::DescriptorSet(rc<DescriptorPool> pool, u32 Index)
-    : Pool(pool), Layout(pool->Layout->DescriptorLayouts[Index].get()), Index(Index)
+DescriptorSet::DescriptorSet(rc<DescriptorPool> pool, rc<PipelineLayout> owner, u32 Index, VkDescriptorSet Handle)
+    : Pool(pool), Owner(owner), Layout(owner->DescriptorLayouts[Index].get()), Index(Index), Handle(Handle)
 {
-    VkDescriptorSetAllocateInfo info = {
-        .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-        .descriptorPool     = Pool->Handle,
-        .descriptorSetCount = 1,
-        .pSetLayouts        = &Layout->Handle,
-    };
+}
 
-    NOSVK_ASSERT(Layout->Vk->AllocateDescriptorSets(&info, &Handle));
+DescriptorSet::DescriptorSet(rc<PipelineLayout> owner, u32 Index)
+    : Owner(owner), Layout(owner->DescriptorLayouts[Index].get()), Index(Index), Handle(VK_NULL_HANDLE), DescriptorData(Layout->DescriptorBufferSize)
+{
+    assert(Owner->Vk->DescriptorBuffers);
 }
 
 DescriptorSet::~DescriptorSet()
 {
-    std::unique_lock lock(Pool->Mutex);
-    Pool->Layout->Vk->FreeDescriptorSets(Pool->Handle, 1, &Handle);
-    Pool->InUse--;
-    if (!Pool->InUse)
+    if (!Pool)
+        return;
+    // Released all at once when the pool is reset
+    if (Pool->Linear)
+        return;
     {
-        if(Pool->Prev)
-			Pool->Prev->Next = Pool->Next;
-
-        if (Pool->Next)
-            Pool->Next->Prev = Pool->Prev;
+        std::unique_lock lock(Pool->Mutex);
+        Pool->Vk->FreeDescriptorSets(Pool->Handle, 1, &Handle);
+        if (--Pool->InUse)
+            return;
     }
+    // AllocateSet never holds a pool's mutex while it takes the chain's, so this order is safe
+    std::unique_lock chain(*Pool->ChainMutex);
+    std::unique_lock lock(Pool->Mutex);
+    if (Pool->InUse || !Pool->Prev)
+        return;
+    Pool->Prev->Next = Pool->Next;
+    if (Pool->Next)
+        Pool->Next->Prev = Pool->Prev;
+    Pool->Prev = 0;
+    Pool->Next = 0;
 }
 
 VkDescriptorType DescriptorSet::GetType(u32 Binding)
@@ -148,12 +253,14 @@ VkDescriptorType DescriptorSet::GetType(u32 Binding)
     return Layout->Bindings[Binding].DescriptorType;
 }
 
-static std::vector<VkDescriptorPoolSize> GetPoolSizes(PipelineLayout* Layout)
+static std::vector<VkDescriptorPoolSize> GetPoolSizes(PipelineLayout* Layout, u32 capacity)
 {
     std::map<VkDescriptorType, u32> counter;
 
-    for (auto& [_, set] : Layout->DescriptorLayouts)
+    for (auto& [idx, set] : Layout->DescriptorLayouts)
     {
+        if (Layout->PushSet == idx || Layout->BindlessSet == idx)
+            continue;
         for (auto& [_, binding] : set->Bindings)
         {
             counter[binding.DescriptorType] += binding.DescriptorCount;
@@ -166,35 +273,56 @@ static std::vector<VkDescriptorPoolSize> GetPoolSizes(PipelineLayout* Layout)
 
     for (auto& [type, count] : counter)
     {
-        Sizes.push_back(VkDescriptorPoolSize{.type = type, .descriptorCount = count * 1024});
+        Sizes.push_back(VkDescriptorPoolSize{.type = type, .descriptorCount = count * capacity});
     }
     return Sizes;
 }
 
-DescriptorPool::DescriptorPool(rc<PipelineLayout> Layout)
-    : DescriptorPool(Layout, GetPoolSizes(Layout.get()))
+static u32 GetPoolCapacity(PipelineLayout* Layout, u32 capacity)
+{
+    return std::clamp(capacity ? capacity : Layout->PoolCapacityHint.load(), 1u, DescriptorPool::MaxCapacity);
+}
+
+DescriptorPool::DescriptorPool(rc<PipelineLayout> Layout, bool Linear, u32 capacity)
+    : DeviceChild(Layout->Vk), Layout(Layout), GroupSetCount(Layout->PooledSetCount()), GroupSizes(GetPoolSizes(Layout.get(), 1)),
+      Linear(Linear), Capacity(GetPoolCapacity(Layout.get(), capacity))
+{
+    CreateHandle();
+}
+
+DescriptorPool::DescriptorPool(Device* Vk, u32 groupSetCount, std::vector<VkDescriptorPoolSize> groupSizes, bool Linear, u32 capacity)
+    : DeviceChild(Vk), GroupSetCount(groupSetCount), GroupSizes(std::move(groupSizes)), Linear(Linear), Capacity(std::clamp(capacity, 1u, MaxCapacity))
 {
+    CreateHandle();
 }
 
-DescriptorPool::DescriptorPool(rc<PipelineLayout> Layout, std::vector<VkDescriptorPoolSize> sizes)
-    : Layout(Layout), Sizes(std::move(sizes)), MaxSets((u32)Layout->DescriptorLayouts.size() * 1024u)
+void DescriptorPool::CreateHandle()
 {
+    Sizes = GroupSizes;
+    for (auto& size : Sizes)
+        size.descriptorCount *= Capacity;
+    MaxSets = std::max(GroupSetCount, 1u) * Capacity;
     VkDescriptorPoolCreateInfo poolInfo = {
         .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-        .flags         = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
+        .flags         = Linear ? 0u : VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
         .maxSets       = MaxSets.load(),
         .poolSizeCount = (u32)Sizes.size(),
         .pPoolSizes    = Sizes.data(),
     };
 
-    NOSVK_ASSERT(Layout->Vk->CreateDescriptorPool(&poolInfo, 0, &Handle));
+    NOSVK_ASSERT(Vk->CreateDescriptorPool(&poolInfo, 0, &Handle));
 }
 
 DescriptorPool::~DescriptorPool()
 {
+    if (Next)
+    {
+        std::unique_lock chain(*ChainMutex);
+        Next->Prev = 0;
+    }
     if (Handle)
     {
-        Layout->Vk->DestroyDescriptorPool(Handle, 0);
+        Vk->DestroyDescriptorPool(Handle, 0);
     }
 }
 
@@ -208,14 +336,69 @@ PipelineLayout::PipelineLayout(Device* Vk, ShaderLayout layout)
         .size   = PushConstantSize,
     };
 
+    u32 uniformBufferCount = 0;
+    bool uniformArrays = false;
+    for (auto& [_, set] : layout.DescriptorSets)
+        for (auto& [_, binding] : set)
+            if (VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER == binding.DescriptorType)
+            {
+                uniformBufferCount += binding.DescriptorCount;
+                uniformArrays |= 1 != binding.DescriptorCount;
+            }
+    // Descriptor buffers have no dynamic descriptors
+    DynamicUniforms = !Vk->DescriptorBuffers && uniformBufferCount && !uniformArrays && uniformBufferCount <= Vk->Props.limits.maxDescriptorSetUniformBuffersDynamic;
+
+    if (Vk->BindlessDescriptors)
+    {
+        for (auto& [idx, set] : layout.DescriptorSets)
+        {
+            if (BindlessHeap::Matches(set))
+            {
+                BindlessSet = idx;
+                break;
+            }
+        }
+    }
+
+    if (Vk->PushDescriptors)
+    {
+        for (auto& [idx, set] : layout.DescriptorSets)
+        {
+            u32 descriptorCount = 0;
+            bool runtimeArray = false;
+            for (auto& [_, binding] : set)
+            {
+                descriptorCount += binding.DescriptorCount;
+                runtimeArray |= -1 == binding.DescriptorCount;
+            }
+            if (!set.empty() && !runtimeArray && BindlessSet != idx && descriptorCount <= Vk->MaxPushDescriptors)
+            {
+                PushSet = idx;
+                break;
+            }
+        }
+    }
+
     for (auto& [idx, set] : layout.DescriptorSets)
     {
         for (auto& [_, binding] : set)
         {
             pushConstantRange.stageFlags |= binding.StageMask;
+            // Dynamic descriptors are not allowed in push descriptor sets
+            if (DynamicUniforms && PushSet != idx && VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER == binding.DescriptorType)
+                binding.DescriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        }
+
+        // Defined identically to the heap's layout so the heap's set can be bound here,
+        // the shader's names and types are kept for TransitionInput and friends
+        if (BindlessSet == idx)
+        {
+            DescriptorLayouts[idx] = DescriptorLayout::New(Vk, Vk->GetBindlessHeap()->GetBindings(set), BindlessHeap::LayoutFlags, BindlessHeap::BindingFlags);
+            handles.push_back(DescriptorLayouts[idx]->Handle);
+            continue;
         }
 
-        auto layout = DescriptorLayout::New(Vk, std::move(set));
+        auto layout = DescriptorLayout::New(Vk, std::move(set), PushSet == idx ? VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR : 0);
 
         std::map<u32, u32> spec;
         
@@ -232,6 +415,8 @@ PipelineLayout::PipelineLayout(Device* Vk, ShaderLayout layout)
 	// Calculate uniform/storage buffer sizes & member offsets
    for (auto& [set, layout] : *this)
     {
+        if (BindlessSet == set)
+            continue;
         for (auto& [binding, dsl] : *layout)
         {
             u32* size = &UniformSize;
@@ -251,6 +436,19 @@ PipelineLayout::PipelineLayout(Device* Vk, ShaderLayout layout)
             if (!(*size) && dsl.SSBO()) {
                 *size = dsl.Type->Members.begin()->second.Type->Size;
             }
+
+            if (VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER == dsl.DescriptorType || VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC == dsl.DescriptorType)
+            {
+                u32 arenaOffset = AlignUp<u32>(UniformArenaSize, (u32)Vk->Props.limits.minUniformBufferOffsetAlignment);
+                UniformBlocks.push_back(UniformBlock{
+                    .Set = set,
+                    .Binding = binding,
+                    .DataOffset = OffsetMap[((u64)set << 32ull) | binding],
+                    .Size = dsl.Type->Size,
+                    .ArenaOffset = arenaOffset,
+                });
+                UniformArenaSize = arenaOffset + dsl.Type->Size;
+            }
         }
     }
 
@@ -302,21 +500,207 @@ rc<DescriptorPool> PipelineLayout::CreatePool()
     return DescriptorPool::New(shared_from_this());
 }
 
+u32 PipelineLayout::PooledSetCount() const
+{
+    return (u32)DescriptorLayouts.size() - (~0u != PushSet) - (~0u != BindlessSet);
+}
 
-rc<DescriptorSet> DescriptorPool::AllocateSet(u32 set)
+void PipelineLayout::PushDescriptorSet(rc<CommandBuffer> Cmd, VkPipelineBindPoint BindPoint, u32 Set, std::set<Binding> const& Resources)
+{
+    assert(PushSet == Set);
+    std::map<u32, std::vector<DescriptorResourceInfo>> infos;
+    std::vector<VkWriteDescriptorSet> writes;
+    u32 count = BuildWrites(*DescriptorLayouts[Set], VK_NULL_HANDLE, Resources, infos, writes);
+    // Nothing else keeps the written resources alive until the command buffer completes
+    for (auto& res : Resources)
+        std::visit([&](auto const& resource) { if (resource) Cmd->AddDependency(resource); }, res.Resource);
+    Cmd->PushDescriptorSetKHR(BindPoint, Handle, Set, count, writes.data());
+}
+
+void PipelineLayout::BindDescriptorBuffers(rc<CommandBuffer> Cmd, VkPipelineBindPoint BindPoint, std::vector<rc<DescriptorSet>> const& Sets)
+{
+    // A single allocation keeps every set in the same buffer
+    VkDeviceSize alignment = Vk->DescriptorBufferProps.descriptorBufferOffsetAlignment;
+    VkDeviceSize size = 0;
+    std::vector<std::pair<DescriptorSet*, VkDeviceSize>> offsets;
+    for (auto& set : Sets)
+    {
+        if (set->DescriptorData.empty())
+            continue;
+        size = AlignUp(size, alignment);
+        offsets.push_back({set.get(), size});
+        size += set->DescriptorData.size();
+    }
+    if (offsets.empty())
+        return;
+    auto alloc = Vk->GetDescriptorRing()->Allocate(Cmd, size, alignment);
+    for (auto& [set, offset] : offsets)
+        memcpy(alloc.Data() + offset, set->DescriptorData.data(), set->DescriptorData.size());
+    // Offsets of sets bound earlier stay valid as long as the buffer is not rebound, which only happens when the ring grows
+    VkDeviceAddress address = alloc.Buffer->GetAddress();
+    if (Cmd->DescriptorBufferAddress != address)
+    {
+        VkDescriptorBufferBindingInfoEXT info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_BUFFER_BINDING_INFO_EXT,
+            .address = address,
+            .usage = alloc.Buffer->Usage,
+        };
+        Cmd->BindDescriptorBuffersEXT(1, &info);
+        Cmd->DescriptorBufferAddress = address;
+    }
+    u32 buffer = 0;
+    for (auto& [set, offset] : offsets)
+    {
+        VkDeviceSize bufferOffset = alloc.Offset + offset;
+        Cmd->SetDescriptorBufferOffsetsEXT(BindPoint, Handle, set->Index, 1, &buffer, &bufferOffset);
+    }
+}
+
+rc<FrameDescriptorPool> PipelineLayout::CreateFramePool()
+{
+    return FrameDescriptorPool::New(shared_from_this());
+}
+
+rc<DescriptorPool> PipelineLayout::GetSharedPool()
+{
+    // A group of sets of any layout with this signature takes the same descriptors from a pool
+    std::vector<u32> signature = {PooledSetCount()};
+    for (auto& size : GetPoolSizes(this, 1))
+    {
+        signature.push_back(size.type);
+        signature.push_back(size.descriptorCount);
+    }
+    std::unique_lock lock(Vk->SharedDescriptorPoolsMutex);
+    auto& pool = Vk->SharedDescriptorPools[signature];
+    // Not tied to this layout, it would otherwise stay alive as long as the device
+    if (!pool)
+        pool = DescriptorPool::New(Vk, PooledSetCount(), GetPoolSizes(this, 1), false, GetPoolCapacity(this, 0));
+    return pool;
+}
+
+
+rc<DescriptorSet> DescriptorPool::AllocateUnlocked(u32 set, rc<PipelineLayout> const& setLayout)
 {
-    std::unique_lock lock(Mutex);
     if (MaxSets == InUse)
+        return nullptr;
+    VkDescriptorSetAllocateInfo info = {
+        .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool     = Handle,
+        .descriptorSetCount = 1,
+        .pSetLayouts        = &setLayout->DescriptorLayouts[set]->Handle,
+    };
+    VkDescriptorSet handle;
+    auto res = Vk->AllocateDescriptorSets(&info, &handle);
+    // A pool can run out of one descriptor type before it runs out of sets
+    if (VK_ERROR_OUT_OF_POOL_MEMORY == res || VK_ERROR_FRAGMENTED_POOL == res)
+        return nullptr;
+    NOSVK_ASSERT(res);
+    u32 inUse = ++InUse;
+    u32 peak = PeakInUse;
+    while (inUse > peak && !PeakInUse.compare_exchange_weak(peak, inUse))
+        ;
+    return DescriptorSet::New(shared_from_this(), setLayout, set, handle);
+}
+
+rc<DescriptorSet> DescriptorPool::TryAllocateSet(u32 set, rc<PipelineLayout> setLayout)
+{
+    std::unique_lock lock(Mutex);
+    return AllocateUnlocked(set, setLayout ? setLayout : Layout);
+}
+
+rc<DescriptorSet> DescriptorPool::AllocateSet(u32 set, rc<PipelineLayout> setLayout)
+{
+    if (!setLayout)
+        setLayout = Layout;
+    assert(setLayout);
+    {
+        std::unique_lock lock(Mutex);
+        if (auto dset = AllocateUnlocked(set, setLayout))
+            return dset;
+    }
+    rc<DescriptorPool> next;
     {
+        std::unique_lock chain(*ChainMutex);
         if (!Next)
         {
-            Next = DescriptorPool::New(Layout);
+            u32 capacity = std::min(Capacity * 2, MaxCapacity);
+            // Pools created later for this layout start at the size it has grown to
+            if (Layout)
+            {
+                u32 hint = Layout->PoolCapacityHint;
+                while (capacity > hint && !Layout->PoolCapacityHint.compare_exchange_weak(hint, capacity))
+                    ;
+            }
+            Next = DescriptorPool::New(Vk, GroupSetCount, GroupSizes, Linear, capacity);
+            Next->Layout = Layout;
+            Next->ChainMutex = ChainMutex;
             Next->Prev = this;
         }
-        return Next->AllocateSet(set);
+        next = Next;
+    }
+    return next->AllocateSet(set, setLayout);
+}
+
+void DescriptorPool::Reset()
+{
+    assert(Linear);
+    std::unique_lock lock(Mutex);
+    NOSVK_ASSERT(Vk->ResetDescriptorPool(Handle, 0));
+    InUse = 0;
+}
+
+FrameDescriptorPool::FrameDescriptorPool(rc<PipelineLayout> Layout)
+    : Layout(Layout)
+{
+    Current = NextPage();
+}
+
+FrameDescriptorPool::Page FrameDescriptorPool::NextPage(u32 capacity)
+{
+    for (auto it = Retired.begin(); it != Retired.end(); ++it)
+    {
+        if (*it->Pending)
+            continue;
+        Page page = std::move(*it);
+        Retired.erase(it);
+        page.Pool->Reset();
+        page.LastRecording = 0;
+        return page;
     }
-    InUse++;
-    return DescriptorSet::New(shared_from_this(), set);
+    return Page{.Pool = DescriptorPool::New(Layout, true, capacity)};
+}
+
+rc<DescriptorSet> FrameDescriptorPool::AllocateSet(u32 set, rc<CommandBuffer> const& cmd)
+{
+    std::unique_lock lock(Mutex);
+    auto dset = Current.Pool->TryAllocateSet(set, Layout);
+    if (!dset)
+    {
+        // Grows past the full page when none of the retired ones can be reused yet
+        u32 capacity = std::min(Current.Pool->Capacity * 2, DescriptorPool::MaxCapacity);
+        Retired.push_back(std::move(Current));
+        Current = NextPage(capacity);
+        dset = Current.Pool->TryAllocateSet(set, Layout);
+        assert(dset);
+    }
+    // One completion callback per recording of cmd
+    if (Current.LastRecording != cmd->RecordingEpoch)
+    {
+        Current.LastRecording = cmd->RecordingEpoch;
+        ++*Current.Pending;
+        cmd->Callbacks.push_back([pending = Current.Pending] { --*pending; });
+    }
+    return dset;
+}
+
+rc<DescriptorSet> ResourcePoolTraits<DescriptorSet, DescriptorSetCreateInfo>::Create(Device* device, DescriptorSetCreateInfo const& info)
+{
+    return info.Pool->AllocateSet(info.Set, info.Layout);
+}
+
+uint64_t ResourcePoolTraits<DescriptorSet, DescriptorSetCreateInfo>::GetKey(DescriptorSet const& set)
+{
+    return uint64_t(set.Handle);
 }
 
 } // namespace nos::vk
\ No newline at end of file
@@ -0,0 +1,336 @@
+// Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+
+#include "nosVulkan/RenderGraph.h"
+#include "nosVulkan/Command.h"
+
+namespace nos::vk
+{
+
+RenderGraph::PassDesc& RenderGraph::PassDesc::Bind(std::string const& name, ResourceId res, VkFilter filter)
+{
+    Images[name] = {res, filter};
+    return *this;
+}
+
+RenderGraph::PassDesc& RenderGraph::PassDesc::BindBuffer(std::string const& name, ResourceId res)
+{
+    Buffers[name] = res;
+    return *this;
+}
+
+RenderGraph::PassDesc& RenderGraph::PassDesc::SetDepth(ResourceId res, bool clear, float clearValue)
+{
+    DepthTarget = res;
+    ExecInfo.BeginInfo.DepthAttachment = Renderpass::DepthAttachmentInfo{.Clear = clear, .ClearValue = clearValue};
+    return *this;
+}
+
+RenderGraph::PassDesc& RenderGraph::PassDesc::OnSetup(std::function<void(Basepass&)> fn)
+{
+    Setup = std::move(fn);
+    return *this;
+}
+
+RenderGraph::RenderGraph(Device* Vk) : DeviceChild(Vk)
+{
+}
+
+RenderGraph::~RenderGraph()
+{
+    ReleaseOutputs();
+}
+
+RenderGraph::ResourceId RenderGraph::Import(rc<vk::Image> image, std::string name)
+{
+    Compiled = false;
+    Resources.push_back(Resource{.Name = std::move(name), .Image = std::move(image)});
+    return ResourceId(Resources.size() - 1);
+}
+
+RenderGraph::ResourceId RenderGraph::Import(rc<vk::Buffer> buffer, std::string name)
+{
+    Compiled = false;
+    Resources.push_back(Resource{.Name = std::move(name), .Buffer = std::move(buffer)});
+    return ResourceId(Resources.size() - 1);
+}
+
+RenderGraph::ResourceId RenderGraph::CreateImage(ImageCreateInfo const& info, std::string name)
+{
+    Compiled = false;
+    Resources.push_back(Resource{.Name = std::move(name), .TransientInfo = info});
+    return ResourceId(Resources.size() - 1);
+}
+
+void RenderGraph::MarkOutput(ResourceId res)
+{
+    Compiled = false;
+    Resources.at(res).Output = true;
+}
+
+RenderGraph::PassDesc& RenderGraph::AddRenderpass(std::string name, rc<Renderpass> pass, ResourceId colorTarget)
+{
+    Compiled = false;
+    auto& desc = Passes.emplace_back();
+    desc.Name = std::move(name);
+    desc.RP = std::move(pass);
+    desc.ColorTarget = colorTarget;
+    return desc;
+}
+
+RenderGraph::PassDesc& RenderGraph::AddComputepass(std::string name, rc<Computepass> pass, u32 x, u32 y, u32 z)
+{
+    Compiled = false;
+    auto& desc = Passes.emplace_back();
+    desc.Name = std::move(name);
+    desc.CP = std::move(pass);
+    desc.GroupCount = {x, y, z};
+    return desc;
+}
+
+void RenderGraph::CollectAccesses(PassDesc& pass)
+{
+    pass.Reads.clear();
+    pass.Writes.clear();
+    auto& layout = *pass.GetPass()->PL->Layout;
+
+    auto add = [&pass](ResourceId res, bool read, bool write) {
+        if (read)
+            pass.Reads.push_back(res);
+        if (write)
+            pass.Writes.push_back(res);
+    };
+
+    for (auto& [name, binding] : pass.Images)
+    {
+        auto it = layout.BindingsByName.find(name);
+        if (it == layout.BindingsByName.end())
+        {
+            GLog.W("RenderGraph: Pass %s has no binding named %s", pass.Name.c_str(), name.c_str());
+            continue;
+        }
+        bool storage = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE == layout[it->second].DescriptorType;
+        add(binding.first, true, storage);
+    }
+
+    for (auto& [name, res] : pass.Buffers)
+    {
+        auto it = layout.BindingsByName.find(name);
+        if (it == layout.BindingsByName.end())
+        {
+            GLog.W("RenderGraph: Pass %s has no binding named %s", pass.Name.c_str(), name.c_str());
+            continue;
+        }
+        auto access = layout[it->second].Access;
+        if (AccessFlagNone == access)
+            access = AccessFlagReadWrite;
+        add(res, access & AccessFlagRead, access & AccessFlagWrite);
+    }
+
+    // Attachments that are loaded instead of cleared also read the previous contents
+    if (InvalidResource != pass.ColorTarget)
+        add(pass.ColorTarget, !pass.ExecInfo.BeginInfo.Clear, true);
+    if (InvalidResource != pass.DepthTarget)
+        add(pass.DepthTarget, !pass.ExecInfo.BeginInfo.DepthAttachment->Clear, true);
+}
+
+void RenderGraph::Compile()
+{
+    ReleaseOutputs();
+    for (auto& res : Resources)
+    {
+        res.FirstUse = ~0u;
+        res.LastUse = 0;
+        res.Slot = ~0u;
+    }
+    Slots.clear();
+
+    // Walk backwards from the resources that are visible outside the graph
+    std::vector<bool> needed(Resources.size());
+    for (u32 i = 0; i < Resources.size(); ++i)
+        needed[i] = !Resources[i].TransientInfo || Resources[i].Output;
+
+    for (auto it = Passes.rbegin(); it != Passes.rend(); ++it)
+    {
+        auto& pass = *it;
+        CollectAccesses(pass);
+        pass.Culled = std::none_of(pass.Writes.begin(), pass.Writes.end(), [&needed](ResourceId res) { return needed[res]; });
+        if (pass.Culled)
+            continue;
+        for (auto res : pass.Reads)
+            needed[res] = true;
+    }
+
+    for (u32 i = 0; i < Passes.size(); ++i)
+    {
+        auto& pass = Passes[i];
+        if (pass.Culled)
+            continue;
+        for (auto& list : {&pass.Reads, &pass.Writes})
+            for (auto id : *list)
+            {
+                auto& res = Resources[id];
+                res.FirstUse = std::min(res.FirstUse, i);
+                res.LastUse = std::max(res.LastUse, i);
+            }
+        for (auto id : pass.Reads)
+            if (Resources[id].TransientInfo && Resources[id].FirstUse == i &&
+                std::find(pass.Writes.begin(), pass.Writes.end(), id) == pass.Writes.end())
+                GLog.W("RenderGraph: Pass %s reads %s before it is written", pass.Name.c_str(), Resources[id].Name.c_str());
+    }
+
+    // Transients that are alive at the same time need separate images, the rest share by first use order
+    std::vector<ResourceId> transients;
+    for (u32 i = 0; i < Resources.size(); ++i)
+        if (Resources[i].TransientInfo && ~0u != Resources[i].FirstUse)
+            transients.push_back(i);
+    std::sort(transients.begin(), transients.end(), [this](ResourceId l, ResourceId r) { return Resources[l].FirstUse < Resources[r].FirstUse; });
+
+    detail::ImageCreateInfoEquals equals;
+    for (auto id : transients)
+    {
+        auto& res = Resources[id];
+        u32 lastUse = res.Output ? u32(Passes.size()) : res.LastUse;
+        auto slot = std::find_if(Slots.begin(), Slots.end(), [&](TransientSlot const& slot) {
+            return slot.LastUse < res.FirstUse && equals(slot.Info, *res.TransientInfo);
+        });
+        if (slot == Slots.end())
+        {
+            res.Slot = u32(Slots.size());
+            Slots.push_back(TransientSlot{.Info = *res.TransientInfo, .LastUse = lastUse, .Name = res.Name});
+        }
+        else
+        {
+            res.Slot = u32(slot - Slots.begin());
+            slot->LastUse = lastUse;
+        }
+        Slots[res.Slot].Output |= res.Output;
+    }
+
+    Compiled = true;
+}
+
+rc<Image> RenderGraph::GetImage(ResourceId id) const
+{
+    auto& res = Resources.at(id);
+    if (res.TransientInfo)
+        return ~0u != res.Slot ? Slots[res.Slot].Image : nullptr;
+    return res.Image;
+}
+
+rc<Image> RenderGraph::TakeImage(ResourceId id)
+{
+    auto& res = Resources.at(id);
+    if (!res.Output || ~0u == res.Slot)
+        return nullptr;
+    return std::move(Slots[res.Slot].Image);
+}
+
+rc<Buffer> RenderGraph::GetBuffer(ResourceId id) const
+{
+    return Resources.at(id).Buffer;
+}
+
+bool RenderGraph::IsCulled(std::string const& passName) const
+{
+    for (auto& pass : Passes)
+        if (pass.Name == passName)
+            return pass.Culled;
+    return false;
+}
+
+void RenderGraph::ScheduleBarriers(PassDesc& pass, rc<CommandBuffer> Cmd)
+{
+    auto base = pass.GetPass();
+    for (auto& [name, binding] : pass.Images)
+        base->TransitionInput(Cmd, name, GetImage(binding.first));
+    for (auto& [name, id] : pass.Buffers)
+        base->TransitionInput(Cmd, name, GetBuffer(id));
+
+    // Same states as Renderpass::Begin, its own transitions become no-ops
+    if (InvalidResource != pass.ColorTarget)
+        GetImage(pass.ColorTarget)->Transition(Cmd, ImageState{
+                                                        .StageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                                                        .AccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                                                        .Layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+                                                    });
+    if (InvalidResource != pass.DepthTarget)
+        GetImage(pass.DepthTarget)->Transition(Cmd, ImageState{
+                                                        .StageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+                                                        .AccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                                                        .Layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+                                                    });
+}
+
+void RenderGraph::ReleaseOutputs()
+{
+    for (auto& slot : Slots)
+        if (slot.Output && slot.Image)
+            Vk->ResourcePools.Image->Release(uint64_t(slot.Image->Handle), OutputCmd);
+    for (auto& slot : Slots)
+        if (slot.Output)
+            slot.Image = nullptr;
+    OutputCmd = nullptr;
+}
+
+void RenderGraph::Execute(rc<CommandBuffer> Cmd)
+{
+    if (!Compiled)
+        Compile();
+    ReleaseOutputs();
+
+    for (auto& slot : Slots)
+        slot.Image = Vk->ResourcePools.Image->Get(slot.Info, "RenderGraph: " + slot.Name, Cmd);
+
+    for (u32 i = 0; i < Passes.size(); ++i)
+    {
+        auto& pass = Passes[i];
+        if (pass.Culled)
+            continue;
+
+        auto base = pass.GetPass();
+        base->Lock();
+        if (pass.Setup)
+            pass.Setup(*base);
+        ScheduleBarriers(pass, Cmd);
+        for (auto& [name, binding] : pass.Images)
+            base->BindResource(name, GetImage(binding.first), binding.second);
+        for (auto& [name, id] : pass.Buffers)
+            base->BindResource(name, GetBuffer(id));
+
+        if (pass.RP)
+        {
+            auto info = pass.ExecInfo;
+            info.BeginInfo.OutImage = GetImage(pass.ColorTarget);
+            if (InvalidResource != pass.DepthTarget)
+                info.BeginInfo.DepthAttachment->DepthBuffer = GetImage(pass.DepthTarget);
+            pass.RP->Exec(Cmd, info);
+        }
+        else
+        {
+            pass.CP->BindResources(Cmd);
+            pass.CP->Dispatch(Cmd, pass.GroupCount.width, pass.GroupCount.height, pass.GroupCount.depth);
+        }
+        base->Unlock();
+    }
+
+    // Pooled images go back once the GPU is done with them, later graphs recorded into Cmd can take them earlier.
+    // Outputs wait for TakeImage or the next Execute.
+    for (auto& slot : Slots)
+    {
+        Cmd->AddDependency(slot.Image);
+        if (!slot.Output)
+            Vk->ResourcePools.Image->Release(uint64_t(slot.Image->Handle), Cmd);
+    }
+    OutputCmd = Cmd;
+}
+
+void RenderGraph::Reset()
+{
+    ReleaseOutputs();
+    Resources.clear();
+    Passes.clear();
+    Slots.clear();
+    Compiled = false;
+}
+
+} // namespace nos::vk
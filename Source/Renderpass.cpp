@@ -5,6 +5,7 @@
 #include "nosVulkan/Common.h"
 #include "nosVulkan/Renderpass.h"
 #include "nosVulkan/Buffer.h"
+#include "nosVulkan/Bindless.h"
 #include "vulkan/vulkan_core.h"
 
 namespace nos::vk
@@ -21,7 +22,6 @@ Renderpass::Renderpass(rc<GraphicsPipeline> PL) : Basepass(PL)
 
 rc<Buffer> Basepass::CreateUniformSizedBuffer()
 {
-	// TODO: Use the resource pool for uniform buffers
 	return Buffer::New(Vk, vk::BufferCreateInfo{
 						   .Size = PL->Layout->UniformSize,
 						   .Usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
@@ -37,10 +37,10 @@ rc<Buffer> Basepass::CreateStorageBuffer(u64 size) {
                            });
 }
 
-Basepass::Basepass(rc<Pipeline> PL) : DeviceChild(PL->GetDevice()), PL(PL), PassDescriptorPool(PL->Layout->CreatePool())
+Basepass::Basepass(rc<Pipeline> PL)
+    : DeviceChild(PL->GetDevice()), PL(PL), PassDescriptorPool(Vk->DescriptorBuffers ? nullptr : PL->Layout->GetSharedPool())
 {
-    if(PL->Layout->UniformSize)
-		UniformBuffer = CreateUniformSizedBuffer();
+    UniformData.resize(PL->Layout->UniformSize);
 
 	for (auto size : PL->Layout->SizeMap)
 	{
@@ -48,6 +48,12 @@ Basepass::Basepass(rc<Pipeline> PL) : DeviceChild(PL->GetDevice()), PL(PL), Pass
 	}
 }
 
+Basepass::~Basepass()
+{
+    for (auto& set : PooledDescriptorSets)
+        Vk->ResourcePools.DescriptorSet->Release(uint64_t(set->Handle));
+}
+
 void Basepass::TransitionInput(rc<vk::CommandBuffer> Cmd, std::string const& name, rc<Image> img)
 {
 	auto& layout = *PL->Layout;
@@ -131,16 +137,6 @@ void Basepass::BindData(std::string const& name, const void* data, uint32_t sz)
     assert(UNIFORM == uniformClass || BUFFER == uniformClass);
     auto [binding, idx, type] = GetBindingAndType(name);
 
-	rc<nos::vk::Buffer> buffer = nullptr;
-    if (uniformClass == UNIFORM) {
-        UniformBufferDirty = true;
-        buffer = UniformBuffer;
-    }
-	else if (uniformClass == BUFFER) {
-		buffer = StorageBuffers[(u64(idx.set) << 32ull) | idx.binding].first;
-		StorageBuffers[(u64(idx.set) << 32ull) | idx.binding].second = true;
-	}
-
     u32 baseOffset = PL->Layout->OffsetMap[((u64)idx.set << 32ull) | idx.binding];
     u32 offset = baseOffset + idx.offset;
     uint32_t copySize = sz ? std::min(sz, type->Size) : type->Size;
@@ -152,9 +148,17 @@ void Basepass::BindData(std::string const& name, const void* data, uint32_t sz)
         copySize = sz;
     }
 
-    auto ptr = buffer->Map() + offset;
-
-    UpdateOrInsert(Bindings[idx.set], vk::Binding(buffer, idx.binding, baseOffset, 0));
+    u8* ptr = nullptr;
+    if (uniformClass == UNIFORM) {
+        // Bound in UploadUniforms
+        ptr = UniformData.data() + offset;
+    }
+	else if (uniformClass == BUFFER) {
+		auto& [buffer, dirty] = StorageBuffers[(u64(idx.set) << 32ull) | idx.binding];
+		dirty = true;
+		ptr = buffer->Map() + offset;
+		UpdateOrInsert(Bindings[idx.set], vk::Binding(buffer, idx.binding, baseOffset, 0));
+	}
 
     memset(ptr, 0, type->Size);
     memcpy(ptr, data, copySize);
@@ -187,18 +191,36 @@ void Renderpass::Exec(rc<vk::CommandBuffer> cmd, const ExecPassInfo& info)
 
 void Basepass::BindResources(rc<vk::CommandBuffer> Cmd)
 {
-    UpdateDescriptorSets();
-    for (auto &set : DescriptorSets)
+    UploadUniforms(Cmd);
+    UpdateDescriptorSets(Cmd);
+    static const std::vector<u32> NoOffsets;
+    auto bindPoint = PL->MainShader->Stage == VK_SHADER_STAGE_FRAGMENT_BIT ? VK_PIPELINE_BIND_POINT_GRAPHICS : VK_PIPELINE_BIND_POINT_COMPUTE;
+    if (Vk->DescriptorBuffers)
+        PL->Layout->BindDescriptorBuffers(Cmd, bindPoint, DescriptorSets);
+    else
     {
-        set->Bind(Cmd, PL->MainShader->Stage == VK_SHADER_STAGE_FRAGMENT_BIT ? VK_PIPELINE_BIND_POINT_GRAPHICS : VK_PIPELINE_BIND_POINT_COMPUTE);
+        for (auto &set : DescriptorSets)
+        {
+            auto offsets = DynamicOffsets.find(set->Index);
+            set->Bind(Cmd, bindPoint, offsets != DynamicOffsets.end() ? offsets->second : NoOffsets);
+        }
     }
     DescriptorSets.clear();
-    RefreshBuffer(Cmd);
+    // Written straight into the command buffer, no set is allocated for it
+    if (auto push = Bindings.find(PL->Layout->PushSet); push != Bindings.end())
+        PL->Layout->PushDescriptorSet(Cmd, bindPoint, push->first, push->second);
+    if (~0u != PL->Layout->BindlessSet)
+        Vk->GetBindlessHeap()->Bind(Cmd, bindPoint, PL->Layout->Handle, PL->Layout->BindlessSet);
+    for (auto& set : PooledDescriptorSets)
+        Vk->ResourcePools.DescriptorSet->Release(uint64_t(set->Handle), Cmd);
+    PooledDescriptorSets.clear();
 }
 
 void Renderpass::Begin(rc<CommandBuffer> cmd, const BeginPassInfo& info)
 {
     assert(info.OutImage);
+    // Render pass objects can only begin in primaries, dynamic rendering can begin in secondaries too
+    assert(Vk->Features.dynamicRendering || VK_COMMAND_BUFFER_LEVEL_PRIMARY == cmd->Level);
     
     rc<ImageView> img = info.OutImage->GetView(VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
 
@@ -216,7 +238,7 @@ void Renderpass::Begin(rc<CommandBuffer> cmd, const BeginPassInfo& info)
 									   .Extent = info.OutImage->GetEffectiveExtent(),
 									   .Format = info.OutImage->GetEffectiveFormat(),
 									   .Usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-									   .Samples = (VkSampleCountFlagBits)PL->MS }, "Temporary Multisample Resource");
+									   .Samples = (VkSampleCountFlagBits)PL->MS }, "Temporary Multisample Resource", cmd);
         localMsBuffer->Transition(cmd, ImageState{
                                             .StageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
                                             .AccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
@@ -252,29 +274,6 @@ void Renderpass::Begin(rc<CommandBuffer> cmd, const BeginPassInfo& info)
 			});
     }
 
-     //for (auto &set : DescriptorSets)
-     //{
-     //    for (auto [img, state] : set->BindStates)
-     //    {
-     //        img->Transition(Cmd, state);
-     //    }
-     //    set->Bind(Cmd);
-     //}
-
-    VkViewport viewport = {
-        .width = (f32)extent.width,
-        .height = (f32)extent.height,
-        .maxDepth = 1.f,
-    };
-
-    VkRect2D scissor = {.extent = extent};
-
-    cmd->SetViewport(0, 1, &viewport);
-    cmd->SetScissor(0, 1, &scissor);
-    cmd->SetDepthTestEnable(false);
-    cmd->SetDepthWriteEnable(false);
-    cmd->SetDepthCompareOp(VK_COMPARE_OP_NEVER);
-
     if (!Vk->Features.dynamicRendering)
     {
         VkRenderPass rp = PL->Handles[img->GetEffectiveFormat()].rp;
@@ -309,7 +308,7 @@ void Renderpass::Begin(rc<CommandBuffer> cmd, const BeginPassInfo& info)
             .pClearValues = &clear,
         };
 
-        cmd->BeginRenderPass(&renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        cmd->BeginRenderPass(&renderPassInfo, info.SecondaryContents ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE);
     }
     else
     {
@@ -342,6 +341,7 @@ void Renderpass::Begin(rc<CommandBuffer> cmd, const BeginPassInfo& info)
         
         VkRenderingInfo renderInfo = {
             .sType = VK_STRUCTURE_TYPE_RENDERING_INFO,
+            .flags = info.SecondaryContents ? VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT : VkRenderingFlags(0),
             .renderArea = {.extent = extent},
             .layerCount = 1,
             .colorAttachmentCount = 1,
@@ -352,6 +352,71 @@ void Renderpass::Begin(rc<CommandBuffer> cmd, const BeginPassInfo& info)
         cmd->BeginRendering(&renderInfo);
     }
 
+    // State set in the primary is not inherited, secondaries set it in BeginSecondary
+    if (info.SecondaryContents)
+        cmd->AddDependency(shared_from_this());
+    else
+        SetupDrawState(cmd, info, img);
+
+	if (localMsBuffer)
+		GetDevice()->ResourcePools.Image->Release(uint64_t(localMsBuffer->Handle), cmd);
+
+}
+
+rc<CommandBuffer> Renderpass::BeginSecondary(rc<CommandPool> pool, const BeginPassInfo& info)
+{
+    assert(info.OutImage);
+
+    rc<ImageView> img = info.OutImage->GetView(VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
+    auto PL = ((GraphicsPipeline*)this->PL.get());
+    VkFormat colorFormat = img->GetEffectiveFormat();
+    rc<Image> optionalDepthBuffer = info.DepthAttachment ? info.DepthAttachment->DepthBuffer : nullptr;
+
+    VkCommandBufferInheritanceRenderingInfo renderingInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO,
+        .colorAttachmentCount = 1,
+        .pColorAttachmentFormats = &colorFormat,
+        .depthAttachmentFormat = optionalDepthBuffer ? optionalDepthBuffer->GetEffectiveFormat() : VK_FORMAT_UNDEFINED,
+        .rasterizationSamples = PL->MS > 1 ? (VkSampleCountFlagBits)PL->MS : VK_SAMPLE_COUNT_1_BIT,
+    };
+
+    VkCommandBufferInheritanceInfo inheritance = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+    };
+
+    if (Vk->Features.dynamicRendering)
+        inheritance.pNext = &renderingInfo;
+    else
+    {
+        inheritance.renderPass = PL->Handles[colorFormat].rp;
+        inheritance.framebuffer = FrameBuffer;
+    }
+
+    auto cmd = pool->BeginSecondaryCmd(&inheritance, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+                                                         VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT);
+    SetupDrawState(cmd, info, img);
+    return cmd;
+}
+
+void Renderpass::SetupDrawState(rc<CommandBuffer> cmd, const BeginPassInfo& info, rc<ImageView> img)
+{
+    auto PL = ((GraphicsPipeline*)this->PL.get());
+    auto extent = img->Src->GetEffectiveExtent();
+
+    VkViewport viewport = {
+        .width = (f32)extent.width,
+        .height = (f32)extent.height,
+        .maxDepth = 1.f,
+    };
+
+    VkRect2D scissor = {.extent = extent};
+
+    cmd->SetViewport(0, 1, &viewport);
+    cmd->SetScissor(0, 1, &scissor);
+    cmd->SetDepthTestEnable(false);
+    cmd->SetDepthWriteEnable(false);
+    cmd->SetDepthCompareOp(VK_COMPARE_OP_NEVER);
+
     auto& handle = PL->Handles[img->GetEffectiveFormat()];
     cmd->BindPipeline(VK_PIPELINE_BIND_POINT_GRAPHICS, info.Wireframe ? handle.wpl : handle.pl);
     cmd->AddDependency(shared_from_this());
@@ -364,9 +429,6 @@ void Renderpass::Begin(rc<CommandBuffer> cmd, const BeginPassInfo& info)
 	}
 	constants = { img->Src->GetExtent(), info.FrameNumber, info.DeltaSeconds };
 	PL->PushConstants(cmd, constants);
-	if (localMsBuffer)
-		GetDevice()->ResourcePools.Image->Release(uint64_t(localMsBuffer->Handle));
-
 }
 
 void Renderpass::End(rc<CommandBuffer> Cmd)
@@ -383,28 +445,166 @@ void Renderpass::End(rc<CommandBuffer> Cmd)
     Bindings.clear();
 }
 
-void Basepass::RefreshBuffer(rc<vk::CommandBuffer> Cmd)
+void Basepass::UploadUniforms(rc<vk::CommandBuffer> Cmd)
 {
-    // Get a new buffer so it's not overwritten by next pass
-    if(UniformBuffer && UniformBufferDirty)
+    auto& layout = *PL->Layout;
+    DynamicOffsets.clear();
+    if (layout.UniformBlocks.empty())
+        return;
+
+    // With dynamic uniforms the descriptors only change when the arena moves to another chunk
+    auto alloc = Vk->GetUniformArena()->Allocate(Cmd, layout.UniformArenaSize);
+    auto dst = alloc.Data();
+    for (auto& block : layout.UniformBlocks)
     {
-        UniformBufferDirty = false;
-        Cmd->AddDependency(UniformBuffer);
-        auto tmp = CreateUniformSizedBuffer();
-        memcpy(tmp->Map(), UniformBuffer->Map(), PL->Layout->UniformSize);
-        UniformBuffer = tmp;
+        memcpy(dst + block.ArenaOffset, UniformData.data() + block.DataOffset, block.Size);
+        u32 offset = u32(alloc.Offset + block.ArenaOffset);
+        if (layout.DynamicUniforms && layout.PushSet != block.Set)
+        {
+            DynamicOffsets[block.Set].push_back(offset);
+            offset = 0;
+        }
+        UpdateOrInsert(Bindings[block.Set], vk::Binding(alloc.Buffer, block.Binding, offset, 0, block.Size));
     }
 }
 
-void Basepass::UpdateDescriptorSets()
+void Basepass::UpdateDescriptorSets(rc<vk::CommandBuffer> Cmd)
 {
     DescriptorSets.clear();
     for (auto &[idx, set] : Bindings)
     {
-        auto dset = PassDescriptorPool->AllocateSet(idx);
-        dset->Update(set);
-        DescriptorSets.push_back(std::move(dset));
+        if (PL->Layout->PushSet != idx && PL->Layout->BindlessSet != idx)
+            DescriptorSets.push_back(GetDescriptorSet(idx, set, Cmd));
+    }
+}
+
+void Basepass::SetFrameScopedDescriptors(bool enabled)
+{
+    // Descriptor buffer sets are already copied into a per command buffer ring on bind
+    FrameDescriptors = enabled && !Vk->DescriptorBuffers ? PL->Layout->CreateFramePool() : nullptr;
+}
+
+bool Basepass::CachedDescriptorSet::IsValid() const
+{
+    return std::none_of(Resources.begin(), Resources.end(), [](auto& res) { return res.expired(); });
+}
+
+rc<DescriptorSet> Basepass::GetDescriptorSet(u32 idx, std::set<vk::Binding> const& bindings, rc<vk::CommandBuffer> const& Cmd)
+{
+    auto& dsl = (*PL->Layout)[idx];
+
+    std::vector<u8> key;
+    std::vector<std::weak_ptr<void>> resources;
+    auto append = [&key](auto const& val) {
+        auto ptr = (const u8*)&val;
+        key.insert(key.end(), ptr, ptr + sizeof(val));
+    };
+
+    // Offsets of static uniform buffers change on every bind, caching those sets would only churn the pool
+    bool cacheable = true;
+    append(idx);
+    for (auto& binding : bindings)
+    {
+        auto type = dsl[binding.Idx].DescriptorType;
+        cacheable &= VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER != type;
+        auto info = binding.GetDescriptorInfo(type);
+        append(binding.Idx);
+        append(binding.ArrayIdx);
+        if (auto img = std::get_if<rc<Image>>(&binding.Resource); img && *img)
+        {
+            append(info.Image.sampler);
+            append(info.Image.imageView);
+            append(info.Image.imageLayout);
+            append((*img)->Generation.load());
+            resources.push_back(*img);
+        }
+        else if (auto buf = std::get_if<rc<Buffer>>(&binding.Resource); buf && *buf)
+        {
+            append(info.Buffer.buffer);
+            append(info.Buffer.offset);
+            append(info.Buffer.range);
+            append((*buf)->Generation.load());
+            resources.push_back(*buf);
+        }
+    }
+
+    if (!cacheable && Vk->DescriptorBuffers)
+    {
+        auto dset = DescriptorSet::New(PL->Layout, idx);
+        dset->Update(bindings);
+        return dset;
+    }
+
+    if (!cacheable && FrameDescriptors && Cmd)
+    {
+        auto dset = FrameDescriptors->AllocateSet(idx, Cmd);
+        dset->Update(bindings);
+        return dset;
+    }
+
+    if (!cacheable)
+    {
+        CountDescriptorAllocation();
+        auto dset = Vk->ResourcePools.DescriptorSet->Get({PassDescriptorPool, idx, PL->Layout}, "Basepass");
+        dset->Update(bindings);
+        PooledDescriptorSets.push_back(dset);
+        return dset;
+    }
+
+    u64 hash = std::hash<std::string_view>()(std::string_view((const char*)key.data(), key.size()));
+    auto it = DescriptorSetCache.find(hash);
+    if (it != DescriptorSetCache.end() && it->second.Key == key && it->second.IsValid())
+    {
+        it->second.LastUse = ++DescriptorSetCacheClock;
+        return it->second.Set;
+    }
+
+    rc<DescriptorSet> dset;
+    if (Vk->DescriptorBuffers)
+        dset = DescriptorSet::New(PL->Layout, idx);
+    else
+    {
+        CountDescriptorAllocation();
+        dset = PassDescriptorPool->AllocateSet(idx, PL->Layout);
+    }
+    dset->Update(bindings);
+    if (it == DescriptorSetCache.end() && DescriptorSetCache.size() >= MaxCachedDescriptorSets)
+        EvictDescriptorSet();
+    DescriptorSetCache[hash] = CachedDescriptorSet{
+        .Set = dset,
+        .Key = std::move(key),
+        .Resources = std::move(resources),
+        .LastUse = ++DescriptorSetCacheClock,
+    };
+    return dset;
+}
+
+void Basepass::CountDescriptorAllocation()
+{
+    if (OwnsDescriptorPool || ++DescriptorAllocations < HotPassAllocations)
+        return;
+    // Sets already allocated keep the shared pool alive until they are released
+    PassDescriptorPool = PL->Layout->CreatePool();
+    OwnsDescriptorPool = true;
+}
+
+void Basepass::EvictDescriptorSet()
+{
+    // Sets that reference dead resources go first, then the least recently used one
+    auto victim = DescriptorSetCache.end();
+    for (auto it = DescriptorSetCache.begin(); it != DescriptorSetCache.end();)
+    {
+        if (!it->second.IsValid())
+        {
+            it = DescriptorSetCache.erase(it);
+            continue;
+        }
+        if (victim == DescriptorSetCache.end() || it->second.LastUse < victim->second.LastUse)
+            victim = it;
+        ++it;
     }
+    if (DescriptorSetCache.size() >= MaxCachedDescriptorSets && victim != DescriptorSetCache.end())
+        DescriptorSetCache.erase(victim);
 }
 
 Renderpass::~Renderpass()
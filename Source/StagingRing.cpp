@@ -0,0 +1,206 @@
+// Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+
+#include "nosVulkan/StagingRing.h"
+#include "nosVulkan/Device.h"
+#include "nosVulkan/Command.h"
+
+namespace nos::vk
+{
+
+StagingRing::StagingRing(Device* Vk, VkDeviceSize capacity, VkBufferUsageFlags usage, MemoryProperties memProps)
+    : DeviceChild(Vk), Capacity(capacity), Alignment(std::max<VkDeviceSize>(Vk->Props.limits.optimalBufferCopyOffsetAlignment, 16)),
+      Usage(usage), MemProps(memProps)
+{
+    Buffer = CreateBuffer(Capacity);
+}
+
+rc<vk::Buffer> StagingRing::CreateBuffer(VkDeviceSize size)
+{
+    return Buffer::New(Vk, BufferCreateInfo{
+                               .Size = size,
+                               .Usage = Usage,
+                               .MemProps = MemProps,
+                               .ExternalMemoryHandleType = 0,
+                           });
+}
+
+std::optional<VkDeviceSize> StagingRing::GetTail()
+{
+    u64 first = std::max(FrontRegion, FirstLiveRegion);
+    if (first - FrontRegion >= Regions.size())
+        return std::nullopt;
+    return Regions[first - FrontRegion].Begin;
+}
+
+std::optional<VkDeviceSize> StagingRing::FindSpace(VkDeviceSize size, VkDeviceSize alignment)
+{
+    auto tail = GetTail();
+    if (!tail)
+    {
+        Head = 0;
+        if (size <= Capacity)
+            return 0;
+        return std::nullopt;
+    }
+    VkDeviceSize aligned = AlignUp(Head, alignment);
+    if (Head > *tail)
+    {
+        // Free space is [Head, Capacity) followed by [0, tail)
+        if (aligned + size <= Capacity)
+            return aligned;
+        if (size <= *tail)
+            return 0;
+    }
+    else if (aligned + size <= *tail)
+        return aligned; // Wrapped, free space is [Head, tail)
+    return std::nullopt;
+}
+
+void StagingRing::Grow(VkDeviceSize size)
+{
+    if (!Regions.empty())
+    {
+        assert(!Regions.back().OldBuffer);
+        Regions.back().OldBuffer = Buffer;
+    }
+    FirstLiveRegion = FrontRegion + Regions.size();
+    Capacity = std::min(MaxCapacity, std::max(Capacity * 2, size));
+    Buffer = CreateBuffer(Capacity);
+    Head = 0;
+    GLog.D("Staging ring is full, growing it to %llu bytes", Capacity);
+}
+
+bool StagingRing::WaitFront(std::unique_lock<std::mutex>& lock)
+{
+    // A read back range is only freed once the callbacks ran, the timeline completing is not enough
+    if (Regions.empty() || Regions.front().HostRead)
+        return false;
+    auto cmd = Regions.front().Cmd.lock();
+    if (!cmd || CommandBuffer::Pending != cmd->State || !cmd->Pool || !cmd->SubmitValue)
+        return false;
+    lock.unlock();
+    bool done = cmd->Pool->WaitForValue(cmd->SubmitValue);
+    lock.lock();
+    return done;
+}
+
+StagingAllocation StagingRing::Allocate(VkDeviceSize size, VkDeviceSize alignment)
+{
+    alignment = std::max(alignment, Alignment);
+    {
+        std::unique_lock lock(Mutex);
+        RetireSubmitted();
+        auto offset = FindSpace(size, alignment);
+        while (!offset && size <= MaxCapacity)
+        {
+            if (Capacity < MaxCapacity)
+                Grow(size);
+            else if (!WaitFront(lock))
+                break;
+            else
+                RetireSubmitted();
+            offset = FindSpace(size, alignment);
+        }
+
+        if (offset)
+        {
+            Regions.push_back(Region{.Begin = *offset, .End = *offset + size});
+            Head = *offset + size;
+            return StagingAllocation{
+                .Buffer = Buffer,
+                .Offset = *offset,
+                .Size = size,
+                .Region = FrontRegion + Regions.size() - 1,
+            };
+        }
+    }
+
+    if (MaxCapacity)
+        GLog.E("Staging ring cannot fit %llu bytes, using a standalone buffer", size);
+    else
+        GLog.D("Staging ring is full, falling back to a standalone staging buffer of %llu bytes", size);
+    return StagingAllocation{
+        .Buffer = CreateBuffer(size),
+        .Offset = 0,
+        .Size = size,
+    };
+}
+
+void StagingRing::Release(rc<CommandBuffer> Cmd, StagingAllocation const& alloc, bool hostRead)
+{
+    if (!alloc.Region)
+    {
+        Cmd->AddDependency(alloc.Buffer);
+        return;
+    }
+    {
+        std::unique_lock lock(Mutex);
+        if (alloc.Region >= FrontRegion)
+        {
+            Regions[alloc.Region - FrontRegion].Cmd = Cmd;
+            Regions[alloc.Region - FrontRegion].HostRead = hostRead;
+        }
+    }
+    // Retires the range if the buffer is cleared before Allocate sees its submission complete
+    Cmd->Callbacks.push_back([ring = shared_from_this(), region = alloc.Region]() { ring->Retire(region); });
+}
+
+StagingAllocation StagingRing::Allocate(rc<CommandBuffer> Cmd, VkDeviceSize size, VkDeviceSize alignment)
+{
+    auto alloc = Allocate(size, alignment);
+    Release(Cmd, alloc);
+    return alloc;
+}
+
+void StagingRing::Retire(u64 region)
+{
+    std::unique_lock lock(Mutex);
+    // Already retired by RetireSubmitted
+    if (region < FrontRegion)
+        return;
+    assert(region - FrontRegion < Regions.size());
+    Regions[region - FrontRegion].Retired = true;
+    PopRetired();
+}
+
+void StagingRing::PopRetired()
+{
+    while (!Regions.empty() && Regions.front().Retired)
+    {
+        Regions.pop_front();
+        ++FrontRegion;
+    }
+    if (Regions.empty())
+        Head = 0;
+}
+
+void StagingRing::RetireSubmitted()
+{
+    // Only the front matters, space is reclaimed in FIFO order
+    CommandBuffer* completed = nullptr;
+    for (auto& region : Regions)
+    {
+        if (region.Retired || region.HostRead)
+            continue;
+        auto cmd = region.Cmd.lock();
+        // SubmitValue is written before the buffer becomes pending
+        if (!cmd || CommandBuffer::Pending != cmd->State || !cmd->Pool || !cmd->SubmitValue)
+            break;
+        if (cmd.get() != completed && cmd->Pool->GetCompletedValue() < cmd->SubmitValue)
+            break;
+        completed = cmd.get();
+        region.Retired = true;
+    }
+    PopRetired();
+}
+
+VkDeviceSize StagingRing::GetUsedSize()
+{
+    std::unique_lock lock(Mutex);
+    auto tail = GetTail();
+    if (!tail)
+        return 0;
+    return Head > *tail ? Head - *tail : Capacity - *tail + Head;
+}
+
+} // namespace nos::vk
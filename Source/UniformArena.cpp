@@ -0,0 +1,87 @@
+// Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+
+#include "nosVulkan/UniformArena.h"
+#include "nosVulkan/Device.h"
+#include "nosVulkan/Command.h"
+
+namespace nos::vk
+{
+
+UniformArena::UniformArena(Device* Vk, VkDeviceSize chunkSize)
+    : DeviceChild(Vk), ChunkSize(chunkSize), Alignment(std::max<VkDeviceSize>(Vk->Props.limits.minUniformBufferOffsetAlignment, 16))
+{
+}
+
+rc<UniformArena::Chunk> UniformArena::CreateChunk(VkDeviceSize size)
+{
+    auto chunk = MakeShared<Chunk>();
+    chunk->Buffer = Buffer::New(Vk, BufferCreateInfo{
+                                        .Size = size,
+                                        .Usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                        .MemProps = {.Mapped = true},
+                                        .ExternalMemoryHandleType = 0,
+                                    });
+    return chunk;
+}
+
+UniformAllocation UniformArena::Allocate(rc<CommandBuffer> Cmd, VkDeviceSize size)
+{
+    std::unique_lock lock(Mutex);
+
+    rc<Chunk> chunk;
+    if (size > ChunkSize)
+    {
+        chunk = CreateChunk(size);
+        chunk->Dedicated = true;
+    }
+    else
+    {
+        if (!Current || AlignUp(Current->Head, Alignment) + size > ChunkSize)
+        {
+            if (Current)
+            {
+                Current->Full = true;
+                if (!Current->Users)
+                    FreeChunks.push_back(std::move(Current));
+            }
+            if (FreeChunks.empty())
+                Current = CreateChunk(ChunkSize);
+            else
+            {
+                Current = std::move(FreeChunks.back());
+                FreeChunks.pop_back();
+                Current->Head = 0;
+                Current->Full = false;
+            }
+        }
+        chunk = Current;
+    }
+
+    VkDeviceSize offset = AlignUp(chunk->Head, Alignment);
+    chunk->Head = offset + size;
+
+    // One completion callback per command buffer is enough to keep the chunk alive
+    if (chunk->LastUser != Cmd.get())
+    {
+        chunk->LastUser = Cmd.get();
+        chunk->Users++;
+        Cmd->Callbacks.push_back([arena = shared_from_this(), chunk, cmd = Cmd.get()]() { arena->Release(chunk, cmd); });
+    }
+
+    return UniformAllocation{
+        .Buffer = chunk->Buffer,
+        .Offset = offset,
+        .Size = size,
+    };
+}
+
+void UniformArena::Release(rc<Chunk> chunk, CommandBuffer* Cmd)
+{
+    std::unique_lock lock(Mutex);
+    if (chunk->LastUser == Cmd)
+        chunk->LastUser = nullptr;
+    if (!--chunk->Users && chunk->Full && !chunk->Dedicated)
+        FreeChunks.push_back(std::move(chunk));
+}
+
+} // namespace nos::vk
@@ -0,0 +1,59 @@
+// Copyright MediaZ Teknoloji A.S. All Rights Reserved.
+
+// Compares the cost of keeping a resource alive per transition: the previous std::function callback that
+// captured an rc<> copy against RetainList. Every resource is transitioned several times per recording.
+
+#include <nosVulkan/Command.h>
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+struct FakeResource
+{
+  int State = 0;
+};
+
+static void EndFake(void* res) { static_cast<FakeResource*>(res)->State = 0; }
+
+int main() {
+  constexpr int Recordings = 2000;
+  constexpr int Resources = 64;
+  constexpr int TransitionsPerResource = 8;
+
+  std::vector<nos::vk::rc<FakeResource>> resources;
+  for (int i = 0; i < Resources; ++i)
+    resources.push_back(nos::vk::MakeShared<FakeResource>());
+
+  using Clock = std::chrono::steady_clock;
+  auto perTransition = [](Clock::duration d) {
+    return std::chrono::duration<double, std::nano>(d).count() / (Recordings * Resources * TransitionsPerResource);
+  };
+
+  std::vector<std::function<void()>> callbacks;
+  auto start = Clock::now();
+  for (int r = 0; r < Recordings; ++r) {
+    for (int t = 0; t < TransitionsPerResource; ++t)
+      for (auto& res : resources)
+        callbacks.push_back([res]() { EndFake(res.get()); });
+    for (auto& fn : callbacks)
+      fn();
+    callbacks.clear();
+  }
+  auto callbackTime = Clock::now() - start;
+
+  nos::vk::RetainList retained;
+  start = Clock::now();
+  for (int r = 0; r < Recordings; ++r) {
+    for (int t = 0; t < TransitionsPerResource; ++t)
+      for (auto& res : resources)
+        retained.Retain(res, &EndFake);
+    retained.Release();
+  }
+  auto retainTime = Clock::now() - start;
+
+  std::cout << "std::function callback: " << perTransition(callbackTime) << " ns/transition" << std::endl;
+  std::cout << "RetainList:             " << perTransition(retainTime) << " ns/transition" << std::endl;
+  return 0;
+}